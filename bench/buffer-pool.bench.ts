@@ -0,0 +1,67 @@
+import { PerformanceObserver } from 'perf_hooks'
+import { BufferPool } from '../src/index.js'
+import { startProxySession } from './harness.js'
+
+const PAYLOAD = Buffer.alloc(64 * 1024 * 1024, 'p')
+const SESSIONS = 4
+
+// Compares bulk stdin ingest over several concurrent connections with every
+// reassembled payload allocated on its own against payloads sliced from a
+// shared pool and released as soon as they've been consumed.
+export default async function run() {
+  const rows = []
+  for (const pooled of [false, true]) {
+    const mode = pooled ? 'pooled' : 'unpooled'
+    rows.push({ mode, ...(await ingest(pooled)) })
+  }
+
+  console.log('\nBuffer pool')
+  console.table(rows)
+}
+
+async function ingest(pooled: boolean) {
+  const pool = pooled ? new BufferPool() : undefined
+  const sessions = await Promise.all(
+    Array.from({ length: SESSIONS }, () =>
+      startProxySession({ bufferPool: pool }),
+    ),
+  )
+
+  let gcCount = 0
+  let gcMs = 0
+  const observer = new PerformanceObserver((list) => {
+    for (const entry of list.getEntries()) {
+      gcCount++
+      gcMs += entry.duration
+    }
+  })
+  observer.observe({ entryTypes: ['gc'] })
+
+  const rssBefore = process.memoryUsage().rss
+  const start = process.hrtime.bigint()
+
+  await Promise.all(
+    sessions.map(({ connection, child }) => {
+      const done = new Promise((resolve) => connection.stdin.on('end', resolve))
+      connection.stdin.on('data', (chunk: Buffer) =>
+        connection.stdin.release(chunk),
+      )
+      child.stdin!.end(PAYLOAD)
+      return done
+    }),
+  )
+
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9
+  const rssGrowth = process.memoryUsage().rss - rssBefore
+  observer.disconnect()
+  await Promise.all(sessions.map(({ close }) => close()))
+
+  const megabytes = (PAYLOAD.length * SESSIONS) / 1024 / 1024
+  return {
+    'MB/s': Math.round(megabytes / seconds),
+    'GC runs': gcCount,
+    'GC (ms)': gcMs.toFixed(1),
+    'RSS growth (MB)': (rssGrowth / 1024 / 1024).toFixed(1),
+    'slabs allocated': pool?.slabsAllocated ?? '-',
+  }
+}
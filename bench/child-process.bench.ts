@@ -0,0 +1,70 @@
+import { spawn, type ChildProcess } from 'child_process'
+import { pipeChildProcess } from '../src/index.js'
+import type { ProcessProxyConnection } from '../src/connection.js'
+import { startProxySession } from './harness.js'
+
+const PAYLOAD = Buffer.alloc(64 * 1024 * 1024, 'c')
+
+type Mode = 'manual' | 'framed' | 'data-channels'
+
+// Compares forwarding a proxy's stdin through a local `cat` and back out of
+// the proxy's stdout the way examples/proxy.ts used to (piping the streams by
+// hand) against pipeChildProcess over the command socket and over data
+// channels. CPU is the server process' user and system time.
+export default async function run() {
+  if (process.platform === 'win32') {
+    return
+  }
+
+  const rows = []
+  for (const mode of ['manual', 'framed', 'data-channels'] as Mode[]) {
+    rows.push({ mode, ...(await forward(mode)) })
+  }
+
+  console.log('\nChild process forwarding (64MB through cat)')
+  console.table(rows)
+}
+
+function pipeManually(
+  connection: ProcessProxyConnection,
+  child: ChildProcess,
+) {
+  connection.stdin.pipe(child.stdin!)
+  child.stdout!.pipe(connection.stdout)
+  child.stderr!.pipe(connection.stderr)
+  child.on('close', (code) => connection.exit(code ?? 0).catch(() => {}))
+}
+
+async function forward(mode: Mode) {
+  const { connection, child: proxy, close } = await startProxySession()
+  let received = 0
+  proxy.stdout!.on('data', (chunk: Buffer) => (received += chunk.length))
+  const exited = new Promise((resolve) => proxy.once('exit', resolve))
+
+  const cpuBefore = process.cpuUsage()
+  const start = process.hrtime.bigint()
+
+  const cat = spawn('cat')
+  if (mode === 'manual') {
+    pipeManually(connection, cat)
+  } else {
+    pipeChildProcess(connection, cat, { framed: mode === 'framed' })
+  }
+  proxy.stdin!.end(PAYLOAD)
+  await exited
+
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9
+  const cpu = process.cpuUsage(cpuBefore)
+  await close()
+
+  if (received !== PAYLOAD.length) {
+    throw new Error(`${mode}: received ${received} of ${PAYLOAD.length}`)
+  }
+
+  const megabytes = PAYLOAD.length / 1024 / 1024
+  return {
+    'MB/s': Math.round(megabytes / seconds),
+    'CPU (ms)': Math.round((cpu.user + cpu.system) / 1000),
+    'CPU µs/MB': Math.round((cpu.user + cpu.system) / megabytes),
+  }
+}
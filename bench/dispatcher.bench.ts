@@ -0,0 +1,79 @@
+import { PerformanceObserver } from 'perf_hooks'
+import { GCProfiler, getHeapStatistics, setFlagsFromString } from 'v8'
+import { runInNewContext } from 'vm'
+import { measure, printResults, startProxySession } from './harness.js'
+
+setFlagsFromString('--expose-gc')
+const gc = runInNewContext('gc') as () => void
+
+// Measures the JavaScript side cost of dispatching commands: time per command,
+// heap allocated per command, minor GCs (scavenges) triggered per 10k commands
+// and heap retained per command once garbage has been collected. Allocations
+// are the growth in used heap plus whatever GCs freed along the way, so they
+// include the socket's own bookkeeping.
+export default async function run() {
+  const { connection, close } = await startProxySession()
+  const readStdin = (n: number) => connection['readStdin'](n)
+  const data = Buffer.alloc(64, 'a')
+
+  let scavenges = 0
+  const observer = new PerformanceObserver((list) => {
+    for (const entry of list.getEntries()) {
+      // NODE_PERFORMANCE_GC_MINOR
+      if ((entry.detail as { kind?: number } | undefined)?.kind === 1) {
+        scavenges++
+      }
+    }
+  })
+  observer.observe({ entryTypes: ['gc'] })
+
+  const cases: [string, () => Promise<unknown>][] = [
+    ['READ_STDIN poll', () => readStdin(16 * 1024)],
+    ['WRITE_STDOUT 64B', () => connection['writeStream'](0x03, data)],
+    ['IS_STDIN_CONNECTED', () => connection.isStdinConnected()],
+    ['GET_ARGS', () => connection.getArgs()],
+  ]
+
+  const results = []
+  for (const [name, fn] of cases) {
+    for (const iterations of [1000, 10000]) {
+      gc()
+      const heapBefore = process.memoryUsage().heapUsed
+      scavenges = 0
+      const profiler = new GCProfiler()
+      profiler.start()
+      const usedBefore = getHeapStatistics().used_heap_size
+
+      const result = await measure(name, iterations, fn)
+
+      const usedAfter = getHeapStatistics().used_heap_size
+      const collected = profiler
+        .stop()
+        .statistics.reduce(
+          (sum, { beforeGC, afterGC }) =>
+            sum +
+            beforeGC.heapStatistics.usedHeapSize -
+            afterGC.heapStatistics.usedHeapSize,
+          0,
+        )
+      const allocated = usedAfter - usedBefore + collected
+
+      // Let the observer catch up before reading the counter
+      await new Promise((resolve) => setImmediate(resolve))
+      const gcs = scavenges
+      gc()
+      const retained = process.memoryUsage().heapUsed - heapBefore
+
+      result.extra = {
+        'allocated B/op': Math.round(allocated / iterations),
+        'scavenges/10k': Math.round((gcs / iterations) * 10000),
+        'retained B/op': Math.max(0, Math.round(retained / iterations)),
+      }
+      results.push(result)
+    }
+  }
+
+  observer.disconnect()
+  await close()
+  printResults('Command dispatcher', results)
+}
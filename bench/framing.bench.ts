@@ -0,0 +1,69 @@
+import { jsFraming, nativeFraming, type Framing } from '../src/index.js'
+import { measure, printResults, startProxySession } from './harness.js'
+
+const BATCH = 1000
+const ENV_VARS = 100
+
+// Compares the per-frame CPU cost of the JavaScript framing against the
+// native addon: encoding command headers, decoding an environment block off
+// the wire and splitting it into an object, and GET_ENV end to end.
+export default async function run() {
+  if (!nativeFraming) {
+    console.log('\nFraming: addon not built, only measuring JavaScript')
+  }
+
+  const env = Array.from(
+    { length: ENV_VARS },
+    (_, i) => `VARIABLE_${i}=/usr/local/share/some/value/${i}`,
+  )
+  const block = Buffer.concat(
+    env.flatMap((str) => {
+      const length = Buffer.alloc(4)
+      length.writeUInt32LE(Buffer.byteLength(str), 0)
+      return [length, Buffer.from(str)]
+    }),
+  )
+  const header = Buffer.alloc(5)
+
+  const results = []
+  for (const framing of [jsFraming, nativeFraming]) {
+    if (!framing) {
+      continue
+    }
+    const mode = framing.native ? 'native' : 'js'
+
+    const frames = await measure(`${mode} encodeHeader`, 1000, async (i) => {
+      for (let j = 0; j < BATCH; j++) {
+        framing.encodeHeader(header, 0x02, i + j)
+      }
+    })
+    frames.extra = { 'ns/frame': ((frames.usPerOp * 1000) / BATCH).toFixed(1) }
+    results.push(frames)
+
+    results.push(
+      await measure(`${mode} decodeStringList`, 10000, async () =>
+        framing.decodeStringList(block, 0, ENV_VARS, []),
+      ),
+    )
+    results.push(
+      await measure(`${mode} parseEnv`, 10000, async () =>
+        framing.parseEnv(env),
+      ),
+    )
+    results.push(await getEnv(framing))
+  }
+
+  printResults(`Framing (${ENV_VARS} variables)`, results)
+}
+
+async function getEnv(framing: Framing) {
+  const { connection, close } = await startProxySession({
+    nativeFraming: framing.native,
+  })
+  const mode = framing.native ? 'native' : 'js'
+  const result = await measure(`${mode} GET_ENV`, 2000, () =>
+    connection.getEnv(),
+  )
+  await close()
+  return result
+}
@@ -0,0 +1,120 @@
+import { AddressInfo } from 'net'
+import { spawn, ChildProcess } from 'child_process'
+import { readFileSync } from 'fs'
+import { createProxyProcessServer, getProxyCommandPath } from '../src/index.js'
+import type { ProcessProxyConnection } from '../src/connection.js'
+
+export interface ProxySession {
+  connection: ProcessProxyConnection
+  child: ChildProcess
+  close: () => Promise<void>
+}
+
+export interface BenchmarkResult {
+  name: string
+  iterations: number
+  totalMs: number
+  usPerOp: number
+  opsPerSec: number
+  extra?: Record<string, string | number>
+}
+
+/**
+ * Starts a proxy server, launches a native proxy against it and resolves
+ * once the proxy has connected. The proxy's stdin is a pipe unless a file
+ * descriptor is given.
+ */
+export async function startProxySession(
+  options?: Parameters<typeof createProxyProcessServer>[1],
+  stdin: 'pipe' | number = 'pipe',
+): Promise<ProxySession> {
+  const { promise, resolve } = Promise.withResolvers<ProcessProxyConnection>()
+  const server = createProxyProcessServer(resolve, options)
+
+  const port = await new Promise<number>((resolve) => {
+    server.listen(0, '127.0.0.1', () => {
+      resolve((server.address() as AddressInfo).port)
+    })
+  })
+
+  const child = spawn(getProxyCommandPath(), ['bench'], {
+    env: { ...process.env, PROCESS_PROXY_PORT: port.toString() },
+    stdio: [stdin, 'pipe', 'pipe'],
+  })
+
+  // Always drain the proxy's output so that it never blocks on a full pipe
+  child.stdout!.resume()
+  child.stderr!.resume()
+
+  const connection = await promise
+
+  return {
+    connection,
+    child,
+    close: async () => {
+      if (!connection.closed) {
+        await connection.exit(0).catch(() => {})
+      }
+      if (child.exitCode === null && child.signalCode === null) {
+        await new Promise((resolve) => child.once('exit', resolve))
+      }
+      await new Promise((resolve) => server.close(resolve))
+    },
+  }
+}
+
+/**
+ * Runs `fn` sequentially `iterations` times after a short warmup and reports
+ * the average cost per operation.
+ */
+export async function measure(
+  name: string,
+  iterations: number,
+  fn: (i: number) => Promise<unknown>,
+): Promise<BenchmarkResult> {
+  const warmup = Math.min(100, Math.ceil(iterations / 10))
+  for (let i = 0; i < warmup; i++) {
+    await fn(i)
+  }
+
+  const start = process.hrtime.bigint()
+  for (let i = 0; i < iterations; i++) {
+    await fn(i)
+  }
+  const totalMs = Number(process.hrtime.bigint() - start) / 1e6
+
+  return {
+    name,
+    iterations,
+    totalMs,
+    usPerOp: (totalMs * 1000) / iterations,
+    opsPerSec: iterations / (totalMs / 1000),
+  }
+}
+
+/**
+ * Returns the resident set size of the given process in kilobytes, or
+ * undefined on platforms where that isn't readily available.
+ */
+export function getProcessRss(pid: number): number | undefined {
+  if (process.platform !== 'linux') {
+    return undefined
+  }
+
+  const status = readFileSync(`/proc/${pid}/status`, 'utf8')
+  const match = /^VmRSS:\s+(\d+)\s+kB/m.exec(status)
+  return match ? Number(match[1]) : undefined
+}
+
+export function printResults(suite: string, results: BenchmarkResult[]) {
+  console.log(`\n${suite}`)
+  console.table(
+    results.map(({ name, iterations, usPerOp, opsPerSec, extra }) => ({
+      name,
+      iterations,
+      'µs/op': usPerOp.toFixed(1),
+      'ops/s': Math.round(opsPerSec),
+      ...extra,
+    })),
+  )
+}
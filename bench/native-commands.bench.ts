@@ -0,0 +1,49 @@
+import {
+  getProcessRss,
+  measure,
+  printResults,
+  startProxySession,
+} from './harness.js'
+
+// Measures the per-command cost of the native command loop and whether the
+// proxy's resident memory stays flat under sustained load.
+export default async function run() {
+  const { connection, child, close } = await startProxySession()
+  const readStdin = (n: number) => connection['readStdin'](n)
+  const writeStdout = (b: Buffer) => connection['writeStream'](0x03, b)
+  const writeStderr = (b: Buffer) => connection['writeStream'](0x04, b)
+  const small = Buffer.alloc(64, 'a')
+  const large = Buffer.alloc(512 * 1024, 'b')
+
+  // Touch the proxy's I/O buffers once so that the RSS baseline reflects its
+  // steady state rather than lazily faulted-in pages.
+  await writeStdout(large)
+  const rssBefore = getProcessRss(child.pid!)
+
+  const results = [
+    await measure('READ_STDIN poll (0 bytes ready, 64KB)', 5000, () =>
+      readStdin(64 * 1024),
+    ),
+    await measure('READ_STDIN poll (0 bytes ready, 1MB)', 5000, () =>
+      readStdin(1024 * 1024),
+    ),
+    await measure('WRITE_STDOUT 64B', 5000, () => writeStdout(small)),
+    await measure('WRITE_STDERR 64B', 5000, () => writeStderr(small)),
+    await measure('WRITE_STDOUT 512KB', 200, () => writeStdout(large)),
+    await measure('IS_STDIN_CONNECTED', 5000, () =>
+      connection.isStdinConnected(),
+    ),
+  ]
+
+  const rssAfter = getProcessRss(child.pid!)
+
+  if (rssBefore !== undefined && rssAfter !== undefined) {
+    results[results.length - 1].extra = {
+      'proxy RSS before (kB)': rssBefore,
+      'proxy RSS after (kB)': rssAfter,
+    }
+  }
+
+  await close()
+  printResults('Native command loop', results)
+}
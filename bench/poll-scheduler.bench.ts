@@ -0,0 +1,72 @@
+import { AddressInfo } from 'net'
+import { spawn } from 'child_process'
+import {
+  createProxyProcessServer,
+  getProxyCommandPath,
+  PollScheduler,
+} from '../src/index.js'
+import type { ProcessProxyConnection } from '../src/connection.js'
+
+const CONNECTIONS = 200
+const DURATION_MS = 3000
+
+// Measures event loop wakeups caused by stdin polling across many idle
+// connections. Without a shared scheduler every flowing stdin stream would
+// arm its own timer for every poll.
+export default async function run() {
+  const pollScheduler = new PollScheduler()
+  const connections: ProcessProxyConnection[] = []
+  const { promise, resolve } = Promise.withResolvers<void>()
+
+  const server = createProxyProcessServer(
+    (connection) => {
+      connections.push(connection)
+      connection.stdin.resume()
+      if (connections.length === CONNECTIONS) {
+        resolve()
+      }
+    },
+    { pollScheduler },
+  )
+
+  const port = await new Promise<number>((resolve) => {
+    server.listen(0, '127.0.0.1', () => {
+      resolve((server.address() as AddressInfo).port)
+    })
+  })
+
+  const children = Array.from({ length: CONNECTIONS }, () =>
+    spawn(getProxyCommandPath(), ['bench'], {
+      env: { ...process.env, PROCESS_PROXY_PORT: port.toString() },
+      stdio: 'pipe',
+    }),
+  )
+
+  await promise
+
+  // Let every stream settle into its idle polling cadence
+  await new Promise((resolve) => setTimeout(resolve, 1000))
+
+  const { ticks, polls } = pollScheduler
+  const cpu = process.cpuUsage()
+  await new Promise((resolve) => setTimeout(resolve, DURATION_MS))
+  const { user, system } = process.cpuUsage(cpu)
+  const seconds = DURATION_MS / 1000
+
+  console.log('\nStdin polling')
+  console.table([
+    {
+      connections: CONNECTIONS,
+      'polls/s': Math.round((pollScheduler.polls - polls) / seconds),
+      'timer wakeups/s': Math.round((pollScheduler.ticks - ticks) / seconds),
+      'CPU ms/s': Math.round((user + system) / 1000 / seconds),
+    },
+  ])
+
+  const exited = children.map(
+    (c) => new Promise((resolve) => c.once('exit', resolve)),
+  )
+  await Promise.all(connections.map((c) => c.exit(0).catch(() => {})))
+  await Promise.all(exited)
+  await new Promise((resolve) => server.close(resolve))
+}
@@ -0,0 +1,17 @@
+import { readdir } from 'fs/promises'
+import { fileURLToPath } from 'url'
+
+// Runs every *.bench.ts file in this directory, or only those whose name
+// contains one of the filters given on the command line.
+const dir = fileURLToPath(new URL('.', import.meta.url))
+const filters = process.argv.slice(2)
+
+const suites = (await readdir(dir))
+  .filter((file) => file.endsWith('.bench.ts'))
+  .filter((file) => !filters.length || filters.some((f) => file.includes(f)))
+  .sort()
+
+for (const suite of suites) {
+  const { default: run } = await import(new URL(suite, import.meta.url).href)
+  await run()
+}
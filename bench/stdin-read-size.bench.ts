@@ -0,0 +1,83 @@
+import { openSync, closeSync, writeFileSync, rmSync } from 'fs'
+import { tmpdir } from 'os'
+import { join } from 'path'
+import { startProxySession } from './harness.js'
+
+const PAYLOAD = Buffer.alloc(64 * 1024 * 1024, 's')
+const ECHOES = 50
+
+// Compares a READ_STDIN size fixed at the stream's highWaterMark against
+// adaptive read sizing, for bulk ingest from a file and a pipe as well as for
+// interactive latency of small writes.
+export default async function run() {
+  const file = join(tmpdir(), `process-proxy-bench-${process.pid}`)
+  writeFileSync(file, PAYLOAD)
+
+  const rows = []
+  for (const adaptive of [false, true]) {
+    const mode = adaptive ? 'adaptive' : 'fixed'
+    rows.push({ mode, ...(await interactive(adaptive)) })
+    rows.push({ mode, ...(await bulk(adaptive, 'pipe')) })
+    rows.push({ mode, ...(await bulk(adaptive, file)) })
+  }
+
+  rmSync(file)
+
+  console.log('\nStdin read sizing')
+  console.table(rows)
+}
+
+async function session(adaptive: boolean, stdin: 'pipe' | number = 'pipe') {
+  const session = await startProxySession(undefined, stdin)
+  if (!adaptive) {
+    session.connection.stdin.maxReadSize = session.connection.stdin.minReadSize
+  }
+  return session
+}
+
+async function interactive(adaptive: boolean) {
+  const { connection, child, close } = await session(adaptive)
+
+  let total = 0
+  for (let i = 0; i < ECHOES; i++) {
+    const start = process.hrtime.bigint()
+    const received = new Promise((resolve) =>
+      connection.stdin.once('data', resolve),
+    )
+    child.stdin!.write('x')
+    await received
+    total += Number(process.hrtime.bigint() - start) / 1e6
+  }
+
+  await close()
+  return { source: 'small writes', 'latency (ms)': (total / ECHOES).toFixed(2) }
+}
+
+async function bulk(adaptive: boolean, source: 'pipe' | string) {
+  const fd = source === 'pipe' ? 'pipe' : openSync(source, 'r')
+  const { connection, child, close } = await session(adaptive, fd)
+
+  const { commands } = connection.stats
+  const start = process.hrtime.bigint()
+  const done = new Promise((resolve) => connection.stdin.on('end', resolve))
+  connection.stdin.resume()
+  child.stdin?.end(PAYLOAD)
+  await done
+
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9
+  const megabytes = PAYLOAD.length / 1024 / 1024
+  const readCommands = connection.stats.commands - commands
+  const readSize = connection.stats.stdinReadSize
+
+  await close()
+  if (typeof fd === 'number') {
+    closeSync(fd)
+  }
+
+  return {
+    source: source === 'pipe' ? 'pipe' : 'file',
+    'MB/s': Math.round(megabytes / seconds),
+    'commands/MB': (readCommands / megabytes).toFixed(1),
+    'read size': readSize,
+  }
+}
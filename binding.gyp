@@ -17,11 +17,6 @@
       }
     }]
   ],
-  "target_defaults": {
-    "sources": [
-      "native/main.c"
-    ],
-  },
   "targets": [
     {
       "target_name": "process-proxy-<(platform)-<(target_arch)",
@@ -60,6 +55,14 @@
           },
         }]
       ]
+    },
+    {
+      # Optional addon taking over the server's framing, see src/framing.ts
+      "target_name": "process-proxy-framing-<(platform)-<(target_arch)",
+      "type": "loadable_module",
+      "sources": [
+        "native/framing.c"
+      ]
     }
   ]
 }
@@ -11,20 +11,10 @@ import { AddressInfo } from 'net'
 import {
   createProxyProcessServer,
   getProxyCommandPath,
+  pipeChildProcess,
   ProcessProxyConnection,
 } from '../src/index.js'
 import { spawn } from 'child_process'
-import { Writable } from 'stream'
-
-const waitForWritableFinished = (stream: Writable) => {
-  return new Promise<void>((resolve) => {
-    if (stream.writableFinished) {
-      resolve()
-    } else {
-      stream.once('finish', () => resolve())
-    }
-  })
-}
 
 const exitWithError = (
   id: string,
@@ -69,12 +59,10 @@ async function main() {
 
       connection.on('close', () => {
         console.log(`${id}: connection closed`)
-        abortController.abort()
       })
 
       connection.on('error', (err) => {
         console.error(`${id}: connection error:`, err)
-        abortController.abort()
       })
 
       const shortenedPath = process.env.HOME
@@ -83,53 +71,23 @@ async function main() {
 
       console.log(`${shortenedPath} $ ${cmd} ${args.join(' ')}`)
 
-      const abortController = new AbortController()
-
-      const child = spawn(cmd, args, {
-        env,
-        cwd,
-        signal: abortController.signal,
-      })
-        .on('spawn', () => {
-          // Pipe data between the native process and copilot
-          connection.stdin.pipe(child.stdin).on('error', (err) => {
-            console.error(`${id}: stdin error:`, err)
-            abortController.abort()
-          })
-
-          child.stdout.pipe(connection.stdout).on('error', (err) => {
-            console.error(`${id}: stdout error:`, err)
-            abortController.abort()
-          })
-          child.stderr.pipe(connection.stderr).on('error', (err) => {
-            console.error(`${id}: stderr error:`, err)
-            abortController.abort()
-          })
-
-          child.on('close', async (code, signal) => {
-            // Ensure all data is flushed to the copilot before exiting
-            // the connection
-            await Promise.all([
-              waitForWritableFinished(connection.stdout),
-              waitForWritableFinished(connection.stderr),
-            ])
-
-            if (code !== 0) {
-              console.log(`${id}: exiting proxy with code ${code}`)
-            }
-            await connection.exit(code ?? 0).catch((err) => {
-              console.error(`${id}: failed to exit proxy: ${err.message}`)
-            })
-          })
-        })
-        .on('error', async (err) => {
+      // Forwards stdin, stdout and stderr over the fastest transport the
+      // proxy supports, kills the child if the proxy goes away and exits the
+      // proxy with the child's exit code.
+      const child = spawn(cmd, args, { env, cwd })
+      await pipeChildProcess(connection, child).then(
+        ({ transport, exitCode }) => {
+          console.log(`${id}: exited with code ${exitCode} (${transport})`)
+        },
+        async (err) => {
           console.error(`${id}: child error: ${err.message}`)
           await exitWithError(
             id,
             connection,
             `Error: command failed: ${err.message}`,
           )
-        })
+        },
+      )
     },
     {
       validateConnection: process.env.PROCESS_PROXY_TOKEN
@@ -0,0 +1,188 @@
+// Optional Node addon implementing the server side framing hot paths. The
+// server falls back to the equivalent JavaScript in src/framing.ts when it
+// isn't available, so both must behave identically.
+
+#define NAPI_VERSION 8
+#include <node_api.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(env, call)                                      \
+    do {                                                      \
+        if ((call) != napi_ok) {                              \
+            napi_throw_error((env), NULL, "N-API call failed"); \
+            return NULL;                                      \
+        }                                                     \
+    } while (0)
+
+static uint32_t read_uint32_le(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static int get_buffer(napi_env env, napi_value value, uint8_t** data, size_t* length) {
+    bool is_buffer = false;
+    if (napi_is_buffer(env, value, &is_buffer) != napi_ok || !is_buffer) {
+        napi_throw_type_error(env, NULL, "Expected a Buffer");
+        return -1;
+    }
+    return napi_get_buffer_info(env, value, (void**)data, length) == napi_ok ? 0 : -1;
+}
+
+// encodeHeader(target, cmd, arg): writes a command byte followed by an
+// optional little endian 32-bit argument to the start of target.
+static napi_value encode_header(napi_env env, napi_callback_info info) {
+    size_t argc = 3;
+    napi_value argv[3];
+    CHECK(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+
+    uint8_t* data;
+    size_t length;
+    if (get_buffer(env, argv[0], &data, &length) != 0) {
+        return NULL;
+    }
+
+    uint32_t cmd;
+    CHECK(env, napi_get_value_uint32(env, argv[1], &cmd));
+
+    napi_valuetype type = napi_undefined;
+    if (argc > 2) {
+        CHECK(env, napi_typeof(env, argv[2], &type));
+    }
+
+    size_t needed = type == napi_undefined ? 1 : 5;
+    if (length < needed) {
+        napi_throw_range_error(env, NULL, "Buffer too small for header");
+        return NULL;
+    }
+
+    data[0] = (uint8_t)cmd;
+    if (needed == 5) {
+        uint32_t arg;
+        CHECK(env, napi_get_value_uint32(env, argv[2], &arg));
+        data[1] = arg & 0xFF;
+        data[2] = (arg >> 8) & 0xFF;
+        data[3] = (arg >> 16) & 0xFF;
+        data[4] = (arg >> 24) & 0xFF;
+    }
+
+    return NULL;
+}
+
+// decodeStringList(buffer, offset, count, items): appends up to count
+// length-prefixed UTF-8 strings starting at offset to items, stopping at the
+// first one that isn't entirely within the buffer. Returns the offset just
+// past the last string decoded.
+static napi_value decode_string_list(napi_env env, napi_callback_info info) {
+    size_t argc = 4;
+    napi_value argv[4];
+    CHECK(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+
+    uint8_t* data;
+    size_t length;
+    if (get_buffer(env, argv[0], &data, &length) != 0) {
+        return NULL;
+    }
+
+    uint32_t offset, count, index;
+    CHECK(env, napi_get_value_uint32(env, argv[1], &offset));
+    CHECK(env, napi_get_value_uint32(env, argv[2], &count));
+    CHECK(env, napi_get_array_length(env, argv[3], &index));
+
+    size_t pos = offset;
+    for (uint32_t i = 0; i < count && pos <= length && length - pos >= 4; i++) {
+        uint32_t item_length = read_uint32_le(data + pos);
+        if (length - pos - 4 < item_length) {
+            break;
+        }
+
+        napi_value str;
+        CHECK(env, napi_create_string_utf8(env, (const char*)data + pos + 4, item_length, &str));
+        CHECK(env, napi_set_element(env, argv[3], index++, str));
+        pos += 4 + (size_t)item_length;
+    }
+
+    napi_value result;
+    CHECK(env, napi_create_uint32(env, (uint32_t)pos, &result));
+    return result;
+}
+
+// parseEnv(list): splits NAME=value strings into an object, skipping entries
+// without a '='.
+static napi_value parse_env(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value list;
+    CHECK(env, napi_get_cb_info(env, info, &argc, &list, NULL, NULL));
+
+    uint32_t count;
+    CHECK(env, napi_get_array_length(env, list, &count));
+
+    napi_value result;
+    CHECK(env, napi_create_object(env, &result));
+
+    char16_t stack_buf[1024];
+    char16_t* buf = stack_buf;
+    size_t capacity = sizeof(stack_buf) / sizeof(stack_buf[0]);
+    napi_value ret = result;
+
+    for (uint32_t i = 0; i < count; i++) {
+        napi_value item;
+        size_t item_length;
+        if (napi_get_element(env, list, i, &item) != napi_ok ||
+            napi_get_value_string_utf16(env, item, NULL, 0, &item_length) != napi_ok) {
+            napi_throw_type_error(env, NULL, "Expected a list of strings");
+            ret = NULL;
+            break;
+        }
+
+        if (item_length + 1 > capacity) {
+            char16_t* grown = malloc((item_length + 1) * sizeof(char16_t));
+            if (!grown) {
+                napi_throw_error(env, NULL, "Out of memory");
+                ret = NULL;
+                break;
+            }
+            if (buf != stack_buf) {
+                free(buf);
+            }
+            buf = grown;
+            capacity = item_length + 1;
+        }
+        napi_get_value_string_utf16(env, item, buf, capacity, &item_length);
+
+        size_t eq = 0;
+        while (eq < item_length && buf[eq] != '=') {
+            eq++;
+        }
+        if (eq == item_length) {
+            continue;
+        }
+
+        napi_value key, value;
+        if (napi_create_string_utf16(env, buf, eq, &key) != napi_ok ||
+            napi_create_string_utf16(env, buf + eq + 1, item_length - eq - 1, &value) != napi_ok ||
+            napi_set_property(env, result, key, value) != napi_ok) {
+            napi_throw_error(env, NULL, "N-API call failed");
+            ret = NULL;
+            break;
+        }
+    }
+
+    if (buf != stack_buf) {
+        free(buf);
+    }
+    return ret;
+}
+
+static napi_value init(napi_env env, napi_value exports) {
+    napi_property_descriptor properties[] = {
+        { "encodeHeader", NULL, encode_header, NULL, NULL, NULL, napi_enumerable, NULL },
+        { "decodeStringList", NULL, decode_string_list, NULL, NULL, NULL, napi_enumerable, NULL },
+        { "parseEnv", NULL, parse_env, NULL, NULL, NULL, napi_enumerable, NULL },
+    };
+    CHECK(env, napi_define_properties(env, exports, sizeof(properties) / sizeof(properties[0]), properties));
+    return exports;
+}
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, init)
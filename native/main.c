@@ -1,3 +1,8 @@
+#ifdef __linux__
+    // Required for POLLRDHUP
+    #define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,10 +26,15 @@
     #include <sys/socket.h>
     #include <sys/stat.h>
     #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
     #include <unistd.h>
     #include <fcntl.h>
     #include <errno.h>
     #include <poll.h>
+    #include <sys/ioctl.h>
+    #include <time.h>
+    #include <signal.h>
     typedef int socket_t;
     #define INVALID_SOCKET_VALUE -1
     #define close_socket close
@@ -42,11 +52,93 @@
 #define CMD_CLOSE_STDOUT 0x0A
 #define CMD_CLOSE_STDERR 0x0B
 #define CMD_IS_STDIN_CONNECTED 0x0C
+#define CMD_RETRY_LATER 0x0D
+#define CMD_UPGRADE_RAW_STDIN 0x0E
+#define CMD_UPGRADE_RAW_STDOUT 0x0F
+#define CMD_OPEN_DATA_CHANNEL 0x10
+#define CMD_GET_BLOCK_DIGESTS 0x11
+#define CMD_PING 0x12
+#define CMD_SET_TIMESTAMPS 0x13
+
+// Handshake: an 18 byte header followed by a 128 byte token. Data channels
+// append the 16 byte key they were opened with.
+#define HANDSHAKE_HEADER "ProcessProxy 0008 "
+#define DATA_CHANNEL_HEADER "ProcessProxy Data "
+#define HANDSHAKE_HEADER_LENGTH 18
+#define HANDSHAKE_TOKEN_LENGTH 128
+#define HANDSHAKE_LENGTH (HANDSHAKE_HEADER_LENGTH + HANDSHAKE_TOKEN_LENGTH)
+#define DATA_CHANNEL_KEY_LENGTH 16
+
+// Status code reserved for unsolicited notifications. A notification is the
+// status followed by a single byte identifying the event, and is only ever
+// sent between responses.
+#define STATUS_NOTIFICATION 1
+
+// Notification identifiers
+#define NOTIFY_STDIN_DISCONNECTED 0x01
+#define NOTIFY_STDOUT_BROKEN 0x02
+#define NOTIFY_STDERR_BROKEN 0x03
 
 // Global variables for argc and argv
 static int g_argc = 0;
 static char** g_argv = NULL;
 static socket_t g_socket = INVALID_SOCKET_VALUE;
+static int g_port = 0;
+
+// Returned by a command handler to drop the connection and reconnect after
+// g_retry_delay_ms milliseconds
+#define HANDLER_RECONNECT 1
+
+// Bounds on how often and for how long a server may turn the proxy away
+// before it gives up
+#define MAX_CONNECT_ATTEMPTS 100
+#define MAX_RETRY_DELAY_MS 10000
+
+static uint32_t g_retry_delay_ms = 0;
+
+// Responses stamped with the time of the I/O they report on, set with
+// CMD_SET_TIMESTAMPS
+#define STAMP_STDIN 0x01
+#define STAMP_STDOUT 0x02
+
+static uint32_t g_stamp_flags = 0;
+
+// Maximum allowed bytes for read_stdin (1MB) to ensure response fits in signed int32
+#define MAX_STDIN_READ_BYTES (1024 * 1024)
+
+// Reusable I/O arena shared by all command handlers. It's sized to hold the
+// largest possible stdin read so that no command needs to touch the heap once
+// the process has started. Write payloads larger than the arena are streamed
+// through it in chunks.
+#define IO_ARENA_SIZE MAX_STDIN_READ_BYTES
+static uint8_t g_io_arena[IO_ARENA_SIZE];
+
+#ifndef _WIN32
+// Standard streams watched for hang-ups while waiting for commands, indexed
+// by file descriptor. A stream stops being watched once it has been reported
+// or closed. Stdin is additionally suspended while it has hung up but still
+// has buffered data, and re-armed after each read.
+static int g_watch_stdio[3] = { 1, 1, 1 };
+
+// Data channels opened with CMD_OPEN_DATA_CHANNEL, indexed by the file
+// descriptor of the stream they carry. They're serviced from the same poll()
+// loop that waits for commands.
+static socket_t g_channels[3] = { INVALID_SOCKET_VALUE, INVALID_SOCKET_VALUE, INVALID_SOCKET_VALUE };
+
+// Stdin that has been read but not yet accepted by its (non-blocking) data
+// channel. Stdin isn't read again until this has been sent.
+#define STDIN_CHANNEL_BUFFER_SIZE (64 * 1024)
+static uint8_t g_stdin_channel_buf[STDIN_CHANNEL_BUFFER_SIZE];
+static size_t g_stdin_channel_off = 0;
+static size_t g_stdin_channel_len = 0;
+
+#ifdef MSG_NOSIGNAL
+    // A data channel closed by the server mustn't kill the proxy
+    #define CHANNEL_SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define CHANNEL_SEND_FLAGS 0
+#endif
+#endif
 
 // Helper function to write exactly n bytes to socket
 static int write_full(socket_t sock, const void* buf, size_t len) {
@@ -78,6 +170,25 @@ static int read_full(socket_t sock, void* buf, size_t len) {
     return 0;
 }
 
+// Nanoseconds on a monotonic clock with an arbitrary starting point
+static uint64_t monotonic_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    uint64_t seconds = (uint64_t)(counter.QuadPart / frequency.QuadPart);
+    uint64_t remainder = (uint64_t)(counter.QuadPart % frequency.QuadPart);
+    return seconds * 1000000000ULL + remainder * 1000000000ULL / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
 // Helper function to send success response
 static int send_success(socket_t sock) {
     int32_t status = 0;
@@ -102,6 +213,60 @@ static int send_error(socket_t sock, const char* error_msg) {
     return write_full(sock, error_msg, msg_len);
 }
 
+// Opens a TCP connection to the server on localhost. Returns
+// INVALID_SOCKET_VALUE on failure.
+static socket_t open_socket(int port) {
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET_VALUE) {
+        return INVALID_SOCKET_VALUE;
+    }
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close_socket(sock);
+        return INVALID_SOCKET_VALUE;
+    }
+    
+    // Commands and responses are small and strictly request/response so
+    // Nagle's algorithm would only add latency to every round trip.
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+    
+    return sock;
+}
+
+// Sends a handshake: an 18 byte protocol header, the 128 byte token from
+// PROCESS_PROXY_TOKEN (null padded) and, for data channels, the channel key.
+static int send_handshake(socket_t sock, const char* header, const uint8_t* key) {
+    uint8_t handshake[HANDSHAKE_LENGTH + DATA_CHANNEL_KEY_LENGTH];
+    memset(handshake, 0, sizeof(handshake));
+    
+    memcpy(handshake, header, HANDSHAKE_HEADER_LENGTH);
+    
+    const char* token_env = getenv("PROCESS_PROXY_TOKEN");
+    if (token_env != NULL) {
+        // Copy token, up to 128 bytes (remaining bytes stay as null padding)
+        size_t token_len = strlen(token_env);
+        if (token_len > HANDSHAKE_TOKEN_LENGTH) {
+            token_len = HANDSHAKE_TOKEN_LENGTH;
+        }
+        memcpy(handshake + HANDSHAKE_HEADER_LENGTH, token_env, token_len);
+    }
+    
+    size_t len = HANDSHAKE_LENGTH;
+    if (key != NULL) {
+        memcpy(handshake + HANDSHAKE_LENGTH, key, DATA_CHANNEL_KEY_LENGTH);
+        len += DATA_CHANNEL_KEY_LENGTH;
+    }
+    
+    return write_full(sock, handshake, len);
+}
+
 // Helper function to get platform-specific error message
 static void get_error_message(char* buffer, size_t buffer_size) {
 #ifdef _WIN32
@@ -111,19 +276,17 @@ static void get_error_message(char* buffer, size_t buffer_size) {
         return;
     }
     
-    LPSTR message_buffer = NULL;
-    size_t size = FormatMessageA(
-        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+    DWORD size = FormatMessageA(
+        FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
         NULL,
         error,
         MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-        (LPSTR)&message_buffer,
-        0,
+        buffer,
+        (DWORD)buffer_size,
         NULL
     );
     
     if (size > 0) {
-        snprintf(buffer, buffer_size, "%s", message_buffer);
         // Remove trailing newlines
         while (size > 0 && (buffer[size-1] == '\r' || buffer[size-1] == '\n')) {
             buffer[--size] = '\0';
@@ -131,10 +294,6 @@ static void get_error_message(char* buffer, size_t buffer_size) {
     } else {
         snprintf(buffer, buffer_size, "Error code: %lu", error);
     }
-    
-    if (message_buffer != NULL) {
-        LocalFree(message_buffer);
-    }
 #else
     int error = errno;
     if (error == 0) {
@@ -151,27 +310,46 @@ static void get_error_message(char* buffer, size_t buffer_size) {
 #endif
 }
 
-// Command handlers
-static int handle_get_args(socket_t sock) {
-    // Send success status
-    if (send_success(sock) < 0) {
+// Receives the serialized form of the argument or environment block, the
+// same bytes whether they're being sent or hashed.
+typedef int (*block_sink_t)(void* ctx, const void* data, uint32_t len);
+
+typedef struct {
+    socket_t sock;
+    int status_sent;
+} response_sink_t;
+
+// Sends the success status ahead of the first bytes of a response, so the
+// command can still fail with an error until it starts writing.
+static int response_sink(void* ctx, const void* data, uint32_t len) {
+    response_sink_t* response = (response_sink_t*)ctx;
+    if (!response->status_sent) {
+        if (send_success(response->sock) < 0) {
+            return -1;
+        }
+        response->status_sent = 1;
+    }
+    return write_full(response->sock, data, len);
+}
+
+static int emit_string(block_sink_t sink, void* ctx, const char* str, uint32_t len) {
+    if (sink(ctx, &len, sizeof(len)) < 0) {
         return -1;
     }
-    
+    return sink(ctx, str, len);
+}
+
+static int emit_args_block(block_sink_t sink, void* ctx) {
     uint32_t count = (uint32_t)g_argc;
     
     // Send count
-    if (write_full(sock, &count, sizeof(count)) < 0) {
+    if (sink(ctx, &count, sizeof(count)) < 0) {
         return -1;
     }
     
     // Send each argument
     for (int i = 0; i < g_argc; i++) {
-        uint32_t len = (uint32_t)strlen(g_argv[i]);
-        if (write_full(sock, &len, sizeof(len)) < 0) {
-            return -1;
-        }
-        if (write_full(sock, g_argv[i], len) < 0) {
+        if (emit_string(sink, ctx, g_argv[i], (uint32_t)strlen(g_argv[i])) < 0) {
             return -1;
         }
     }
@@ -179,8 +357,11 @@ static int handle_get_args(socket_t sock) {
     return 0;
 }
 
-// Maximum allowed bytes for read_stdin (1MB) to ensure response fits in signed int32
-#define MAX_STDIN_READ_BYTES (1024 * 1024)
+// Command handlers
+static int handle_get_args(socket_t sock) {
+    response_sink_t response = { sock, 0 };
+    return emit_args_block(response_sink, &response);
+}
 
 static int handle_read_stdin(socket_t sock) {
     uint32_t max_bytes;
@@ -195,191 +376,159 @@ static int handle_read_stdin(socket_t sock) {
         max_bytes = MAX_STDIN_READ_BYTES;
     }
     
-    if (max_bytes == 0) {
-        // Send success with 0 bytes read
-        if (send_success(sock) < 0) {
-            return -1;
-        }
-        int32_t bytes_read = 0;
-        return write_full(sock, &bytes_read, sizeof(bytes_read));
-    }
-    
-    // Allocate buffer
-    uint8_t* buffer = (uint8_t*)malloc(max_bytes);
-    if (!buffer) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
-    }
+    int32_t bytes_read = 0;
     
-    // Set stdin to non-blocking mode
+    if (max_bytes > 0) {
 #ifdef _WIN32
-    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    DWORD bytes_available = 0;
-    if (!PeekNamedPipe(hStdin, NULL, 0, NULL, &bytes_available, NULL)) {
-        // stdin might be closed
-        free(buffer);
-        if (send_success(sock) < 0) {
-            return -1;
-        }
-        int32_t bytes_read = -1;
-        return write_full(sock, &bytes_read, sizeof(bytes_read));
-    }
-    
-    int32_t bytes_read = 0;
-    if (bytes_available > 0) {
-        DWORD to_read = (bytes_available < (DWORD)max_bytes) ? bytes_available : (DWORD)max_bytes;
-        DWORD actual_read = 0;
-        if (ReadFile(hStdin, buffer, to_read, &actual_read, NULL)) {
-            bytes_read = (int32_t)actual_read;
-        } else {
+        HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+        DWORD bytes_available = 0;
+        if (!PeekNamedPipe(hStdin, NULL, 0, NULL, &bytes_available, NULL)) {
+            // stdin might be closed
             bytes_read = -1;
+        } else if (bytes_available > 0) {
+            DWORD to_read = (bytes_available < (DWORD)max_bytes) ? bytes_available : (DWORD)max_bytes;
+            DWORD actual_read = 0;
+            if (ReadFile(hStdin, g_io_arena, to_read, &actual_read, NULL)) {
+                bytes_read = (int32_t)actual_read;
+            } else {
+                bytes_read = -1;
+            }
         }
-    }
 #else
-    // Set stdin to non-blocking
-    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
-    
-    ssize_t result = read(STDIN_FILENO, buffer, max_bytes);
-    int32_t bytes_read;
-    
-    if (result < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            bytes_read = 0;
-        } else {
+        // Check for readiness first rather than toggling O_NONBLOCK on the
+        // (potentially shared) file description. Idle polls then cost a single
+        // syscall and a read is only issued when it's guaranteed not to block.
+        struct pollfd pfd;
+        pfd.fd = STDIN_FILENO;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        int ready = poll(&pfd, 1, 0);
+        
+        if (ready < 0 || (pfd.revents & POLLNVAL)) {
             bytes_read = -1;
+        } else if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t result = read(STDIN_FILENO, g_io_arena, max_bytes);
+            
+            if (result < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    bytes_read = 0;
+                } else {
+                    bytes_read = -1;
+                }
+            } else if (result == 0) {
+                bytes_read = -1; // EOF
+            } else {
+                bytes_read = (int32_t)result;
+            }
         }
-    } else if (result == 0) {
-        bytes_read = -1; // EOF
-    } else {
-        bytes_read = (int32_t)result;
-    }
-    
-    // Restore blocking mode
-    fcntl(STDIN_FILENO, F_SETFL, flags);
 #endif
+    }
     
-    // Send success status
-    if (send_success(sock) < 0) {
-        free(buffer);
+    // Send success status, bytes read and (if requested) the time they were
+    // read as a single write. The timestamp precedes the data and counts
+    // towards its length.
+    uint8_t header[16];
+    size_t header_length = 8;
+    int32_t status_and_length[2] = { 0, bytes_read };
+    if (bytes_read > 0 && (g_stamp_flags & STAMP_STDIN)) {
+        uint64_t read_at = monotonic_ns();
+        memcpy(header + 8, &read_at, sizeof(read_at));
+        status_and_length[1] += (int32_t)sizeof(read_at);
+        header_length = 16;
+    }
+    memcpy(header, status_and_length, sizeof(status_and_length));
+    if (write_full(sock, header, header_length) < 0) {
         return -1;
     }
     
-    // Send bytes read
-    if (write_full(sock, &bytes_read, sizeof(bytes_read)) < 0) {
-        free(buffer);
-        return -1;
+#ifndef _WIN32
+    // Re-evaluate stdin for hang-ups now that its buffer may have drained
+    if (g_watch_stdio[STDIN_FILENO] < 0) {
+        g_watch_stdio[STDIN_FILENO] = 1;
     }
+#endif
     
     // Send data if any was read
     if (bytes_read > 0) {
-        if (write_full(sock, buffer, bytes_read) < 0) {
-            free(buffer);
-            return -1;
-        }
+        return write_full(sock, g_io_arena, bytes_read);
     }
     
-    free(buffer);
     return 0;
 }
 
-static int handle_write_stdout(socket_t sock) {
+// Copies a length-prefixed payload from the socket to the given stream,
+// passing it through the I/O arena in chunks. The whole payload is always
+// consumed from the socket, even if writing to the stream fails, so that the
+// command stream stays in sync.
+static int handle_write_stream(socket_t sock, FILE* stream) {
     uint32_t len;
     
     // Read length
     if (read_full(sock, &len, sizeof(len)) < 0) {
         return -1;
     }
-
-    if (len == 0) {
-        return send_success(sock);
-    }
-
     
-    // Read data
-    uint8_t* buffer = (uint8_t*)malloc(len);
-    if (!buffer) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
-    }
+    int write_failed = 0;
+    char error_msg[256];
     
-    if (read_full(sock, buffer, len) < 0) {
-        free(buffer);
-        return -1;
+    while (len > 0) {
+        uint32_t chunk = len < IO_ARENA_SIZE ? len : IO_ARENA_SIZE;
+        
+        if (read_full(sock, g_io_arena, chunk) < 0) {
+            return -1;
+        }
+        
+        if (!write_failed && fwrite(g_io_arena, 1, chunk, stream) != chunk) {
+            get_error_message(error_msg, sizeof(error_msg));
+            write_failed = 1;
+        }
+        
+        len -= chunk;
     }
     
-    // Write to stdout
-    size_t written = fwrite(buffer, 1, len, stdout);
-    fflush(stdout);
-    
-    free(buffer);
-    
-    if (written != len) {
-        char error_msg[256];
+    if (!write_failed && fflush(stream) != 0) {
         get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
-    }
-    
-    return send_success(sock);
-}
-
-static int handle_write_stderr(socket_t sock) {
-    uint32_t len;
-    
-    // Read length
-    if (read_full(sock, &len, sizeof(len)) < 0) {
-        return -1;
-    }
-    
-    if (len == 0) {
-        return send_success(sock);
+        write_failed = 1;
     }
     
-    // Read data
-    uint8_t* buffer = (uint8_t*)malloc(len);
-    if (!buffer) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
+    if (write_failed) {
         return send_error(sock, error_msg);
     }
     
-    if (read_full(sock, buffer, len) < 0) {
-        free(buffer);
-        return -1;
-    }
-    
-    // Write to stderr
-    size_t written = fwrite(buffer, 1, len, stderr);
-    fflush(stderr);
-    
-    free(buffer);
-    
-    if (written != len) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
+    if (stream == stdout && (g_stamp_flags & STAMP_STDOUT)) {
+        // Followed by the time the bytes were handed to the stdout fd
+        uint64_t written_at = monotonic_ns();
+        uint8_t response[16];
+        int32_t status_and_length[2] = { 0, (int32_t)sizeof(written_at) };
+        memcpy(response, status_and_length, sizeof(status_and_length));
+        memcpy(response + 8, &written_at, sizeof(written_at));
+        return write_full(sock, response, sizeof(response));
     }
     
     return send_success(sock);
 }
 
+static int handle_write_stdout(socket_t sock) {
+    return handle_write_stream(sock, stdout);
+}
+
+static int handle_write_stderr(socket_t sock) {
+    return handle_write_stream(sock, stderr);
+}
+
 static int handle_get_cwd(socket_t sock) {
 #ifdef _WIN32
+    // Preallocated so that long working directories don't require a heap
+    // allocation on every call.
+    static WCHAR long_path[32768];
     WCHAR wide_path[MAX_PATH + 1];
     DWORD len = GetCurrentDirectoryW(MAX_PATH, wide_path);
     
     if (len == 0 || len > MAX_PATH) {
         // Try with longer path or get short path
-        WCHAR* long_path = (WCHAR*)malloc(32768 * sizeof(WCHAR));
-        if (!long_path) {
-            return send_error(sock, "Failed to allocate memory for path");
-        }
-        
         len = GetCurrentDirectoryW(32768, long_path);
         if (len == 0 || len > 32768) {
-            free(long_path);
             char error_msg[256];
             get_error_message(error_msg, sizeof(error_msg));
             return send_error(sock, error_msg);
@@ -396,40 +545,28 @@ static int handle_get_cwd(socket_t sock) {
         } else {
             wcscpy_s(wide_path, MAX_PATH, long_path);
         }
-        
-        free(long_path);
     }
     
-    // Convert to UTF-8
-    int utf8_len = WideCharToMultiByte(CP_UTF8, 0, wide_path, -1, NULL, 0, NULL, NULL);
+    // Convert to UTF-8 directly into the I/O arena
+    char* utf8_path = (char*)g_io_arena;
+    int utf8_len = WideCharToMultiByte(CP_UTF8, 0, wide_path, -1, utf8_path, IO_ARENA_SIZE, NULL, NULL);
     if (utf8_len <= 0) {
         char error_msg[256];
         get_error_message(error_msg, sizeof(error_msg));
         return send_error(sock, error_msg);
     }
     
-    char* utf8_path = (char*)malloc(utf8_len);
-    if (!utf8_path) {
-        return send_error(sock, "Failed to allocate memory for UTF-8 path");
-    }
-    
-    WideCharToMultiByte(CP_UTF8, 0, wide_path, -1, utf8_path, utf8_len, NULL, NULL);
-    
     // Send success status
     if (send_success(sock) < 0) {
-        free(utf8_path);
         return -1;
     }
     
     uint32_t path_len = (uint32_t)(utf8_len - 1); // -1 to exclude null terminator
     if (write_full(sock, &path_len, sizeof(path_len)) < 0) {
-        free(utf8_path);
         return -1;
     }
     
-    int result = write_full(sock, utf8_path, path_len);
-    free(utf8_path);
-    return result;
+    return write_full(sock, utf8_path, path_len);
 #else
     char cwd[4096];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
@@ -452,13 +589,12 @@ static int handle_get_cwd(socket_t sock) {
 #endif
 }
 
-static int handle_get_env(socket_t sock) {
+// Returns -2 without emitting anything if the environment can't be read
+static int emit_env_block(block_sink_t sink, void* ctx) {
 #ifdef _WIN32
     LPWCH env_block = GetEnvironmentStringsW();
     if (!env_block) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
+        return -2;
     }
     
     // Count environment variables
@@ -469,14 +605,8 @@ static int handle_get_env(socket_t sock) {
         ptr += wcslen(ptr) + 1;
     }
     
-    // Send success status
-    if (send_success(sock) < 0) {
-        FreeEnvironmentStringsW(env_block);
-        return -1;
-    }
-    
     // Send count
-    if (write_full(sock, &count, sizeof(count)) < 0) {
+    if (sink(ctx, &count, sizeof(count)) < 0) {
         FreeEnvironmentStringsW(env_block);
         return -1;
     }
@@ -484,35 +614,21 @@ static int handle_get_env(socket_t sock) {
     // Send each variable
     ptr = env_block;
     while (*ptr) {
-        // Convert to UTF-8
-        int utf8_len = WideCharToMultiByte(CP_UTF8, 0, ptr, -1, NULL, 0, NULL, NULL);
+        // Convert to UTF-8 into the I/O arena. A single variable is capped
+        // at 32767 UTF-16 code units so it always fits.
+        char* utf8_str = (char*)g_io_arena;
+        int utf8_len = WideCharToMultiByte(CP_UTF8, 0, ptr, -1, utf8_str, IO_ARENA_SIZE, NULL, NULL);
         if (utf8_len <= 0) {
             FreeEnvironmentStringsW(env_block);
             return -1;
         }
         
-        char* utf8_str = (char*)malloc(utf8_len);
-        if (!utf8_str) {
-            FreeEnvironmentStringsW(env_block);
-            return -1;
-        }
-        
-        WideCharToMultiByte(CP_UTF8, 0, ptr, -1, utf8_str, utf8_len, NULL, NULL);
-        
-        uint32_t str_len = (uint32_t)(utf8_len - 1); // -1 to exclude null terminator
-        if (write_full(sock, &str_len, sizeof(str_len)) < 0) {
-            free(utf8_str);
-            FreeEnvironmentStringsW(env_block);
-            return -1;
-        }
-        
-        if (write_full(sock, utf8_str, str_len) < 0) {
-            free(utf8_str);
+        // -1 to exclude null terminator
+        if (emit_string(sink, ctx, utf8_str, (uint32_t)(utf8_len - 1)) < 0) {
             FreeEnvironmentStringsW(env_block);
             return -1;
         }
         
-        free(utf8_str);
         ptr += wcslen(ptr) + 1;
     }
     
@@ -526,23 +642,14 @@ static int handle_get_env(socket_t sock) {
         count++;
     }
     
-    // Send success status
-    if (send_success(sock) < 0) {
-        return -1;
-    }
-    
     // Send count
-    if (write_full(sock, &count, sizeof(count)) < 0) {
+    if (sink(ctx, &count, sizeof(count)) < 0) {
         return -1;
     }
     
     // Send each variable
     for (char** env = environ; *env; env++) {
-        uint32_t len = (uint32_t)strlen(*env);
-        if (write_full(sock, &len, sizeof(len)) < 0) {
-            return -1;
-        }
-        if (write_full(sock, *env, len) < 0) {
+        if (emit_string(sink, ctx, *env, (uint32_t)strlen(*env)) < 0) {
             return -1;
         }
     }
@@ -551,68 +658,256 @@ static int handle_get_env(socket_t sock) {
     return 0;
 }
 
-static int handle_exit_cmd(socket_t sock) {
-    int32_t exit_code;
-    
-    // Read exit code
-    if (read_full(sock, &exit_code, sizeof(exit_code)) < 0) {
-        return -1;
-    }
-    
-    // Send success response before exiting
-    send_success(sock);
-    
-    // Close socket and exit
-    close_socket(sock);
-    exit(exit_code);
+static int handle_get_env(socket_t sock) {
+    response_sink_t response = { sock, 0 };
+    int result = emit_env_block(response_sink, &response);
     
-    return 0; // Never reached
-}
-
-static int handle_close_stdin(socket_t sock) {
-#ifdef _WIN32
-    if (!CloseHandle(GetStdHandle(STD_INPUT_HANDLE))) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
-    }
-#else
-    if (close(STDIN_FILENO) < 0) {
+    if (result == -2) {
         char error_msg[256];
         get_error_message(error_msg, sizeof(error_msg));
         return send_error(sock, error_msg);
     }
-#endif
-    return send_success(sock);
+    
+    return result;
 }
 
-static int handle_close_stdout(socket_t sock) {
-    fflush(stdout);
-#ifdef _WIN32
-    if (!CloseHandle(GetStdHandle(STD_OUTPUT_HANDLE))) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
+// SHA-256, used to identify argument and environment blocks by content so
+// the server can share a single copy between proxies launched alike.
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    uint32_t used;
+} sha256_t;
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(sha256_t* sha) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+static void sha256_compress(sha256_t* sha) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)sha->block[i * 4] << 24) | ((uint32_t)sha->block[i * 4 + 1] << 16) |
+               ((uint32_t)sha->block[i * 4 + 2] << 8) | (uint32_t)sha->block[i * 4 + 3];
     }
-#else
-    if (close(STDOUT_FILENO) < 0) {
-        char error_msg[256];
-        get_error_message(error_msg, sizeof(error_msg));
-        return send_error(sock, error_msg);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
-#endif
-    return send_success(sock);
+    
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+    
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    
+    sha->state[0] += a; sha->state[1] += b; sha->state[2] += c; sha->state[3] += d;
+    sha->state[4] += e; sha->state[5] += f; sha->state[6] += g; sha->state[7] += h;
 }
 
-static int handle_close_stderr(socket_t sock) {
-    fflush(stderr);
-#ifdef _WIN32
-    if (!CloseHandle(GetStdHandle(STD_ERROR_HANDLE))) {
+static int sha256_sink(void* ctx, const void* data, uint32_t len) {
+    sha256_t* sha = (sha256_t*)ctx;
+    const uint8_t* bytes = (const uint8_t*)data;
+    
+    sha->length += len;
+    while (len > 0) {
+        uint32_t chunk = 64 - sha->used;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(sha->block + sha->used, bytes, chunk);
+        sha->used += chunk;
+        bytes += chunk;
+        len -= chunk;
+        
+        if (sha->used == 64) {
+            sha256_compress(sha);
+            sha->used = 0;
+        }
+    }
+    
+    return 0;
+}
+
+static void sha256_final(sha256_t* sha, uint8_t digest[32]) {
+    uint64_t bits = sha->length * 8;
+    
+    sha->block[sha->used++] = 0x80;
+    if (sha->used > 56) {
+        memset(sha->block + sha->used, 0, 64 - sha->used);
+        sha256_compress(sha);
+        sha->used = 0;
+    }
+    memset(sha->block + sha->used, 0, 56 - sha->used);
+    for (int i = 0; i < 8; i++) {
+        sha->block[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    sha256_compress(sha);
+    
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(sha->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(sha->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(sha->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)sha->state[i];
+    }
+}
+
+// Digests of the argument block followed by the environment block, in the
+// exact format 0x01 and 0x06 send them. Computed on first use, neither block
+// changes during the lifetime of the process.
+static uint8_t g_block_digests[64];
+static int g_block_digests_ready = 0;
+
+static int handle_get_block_digests(socket_t sock) {
+    if (!g_block_digests_ready) {
+        sha256_t sha;
+        
+        sha256_init(&sha);
+        emit_args_block(sha256_sink, &sha);
+        sha256_final(&sha, g_block_digests);
+        
+        sha256_init(&sha);
+        if (emit_env_block(sha256_sink, &sha) != 0) {
+            char error_msg[256];
+            get_error_message(error_msg, sizeof(error_msg));
+            return send_error(sock, error_msg);
+        }
+        sha256_final(&sha, g_block_digests + 32);
+        
+        g_block_digests_ready = 1;
+    }
+    
+    int32_t length = (int32_t)sizeof(g_block_digests);
+    if (send_success(sock) < 0 || write_full(sock, &length, sizeof(length)) < 0) {
+        return -1;
+    }
+    return write_full(sock, g_block_digests, sizeof(g_block_digests));
+}
+
+// Responds with the time the ping was received and the time the response
+// was sent, from which the server estimates the offset between its clock and
+// ours along with the round trip time.
+static int handle_ping(socket_t sock) {
+    uint64_t received_at = monotonic_ns();
+    uint8_t response[24];
+    int32_t status_and_length[2] = { 0, 16 };
+    memcpy(response, status_and_length, sizeof(status_and_length));
+    memcpy(response + 8, &received_at, sizeof(received_at));
+    uint64_t sent_at = monotonic_ns();
+    memcpy(response + 16, &sent_at, sizeof(sent_at));
+    return write_full(sock, response, sizeof(response));
+}
+
+static int handle_set_timestamps(socket_t sock) {
+    uint32_t flags;
+    if (read_full(sock, &flags, sizeof(flags)) < 0) {
+        return -1;
+    }
+    g_stamp_flags = flags & (STAMP_STDIN | STAMP_STDOUT);
+    return send_success(sock);
+}
+
+#ifndef _WIN32
+static void drain_output_channels(socket_t sock);
+static void close_channel(int fd);
+#endif
+
+static int handle_exit_cmd(socket_t sock) {
+    int32_t exit_code;
+    
+    // Read exit code
+    if (read_full(sock, &exit_code, sizeof(exit_code)) < 0) {
+        return -1;
+    }
+    
+#ifndef _WIN32
+    // The server ends its data channels before exiting, make sure everything
+    // sent on them has been written out first.
+    drain_output_channels(sock);
+#endif
+    
+    // Send success response before exiting
+    send_success(sock);
+    
+    // Close socket and exit
+    close_socket(sock);
+    exit(exit_code);
+    
+    return 0; // Never reached
+}
+
+static int handle_close_stdin(socket_t sock) {
+#ifdef _WIN32
+    if (!CloseHandle(GetStdHandle(STD_INPUT_HANDLE))) {
         char error_msg[256];
         get_error_message(error_msg, sizeof(error_msg));
         return send_error(sock, error_msg);
     }
 #else
+    g_watch_stdio[STDIN_FILENO] = 0;
+    close_channel(STDIN_FILENO);
+    if (close(STDIN_FILENO) < 0) {
+        char error_msg[256];
+        get_error_message(error_msg, sizeof(error_msg));
+        return send_error(sock, error_msg);
+    }
+#endif
+    return send_success(sock);
+}
+
+static int handle_close_stdout(socket_t sock) {
+    fflush(stdout);
+#ifdef _WIN32
+    if (!CloseHandle(GetStdHandle(STD_OUTPUT_HANDLE))) {
+        char error_msg[256];
+        get_error_message(error_msg, sizeof(error_msg));
+        return send_error(sock, error_msg);
+    }
+#else
+    g_watch_stdio[STDOUT_FILENO] = 0;
+    if (close(STDOUT_FILENO) < 0) {
+        char error_msg[256];
+        get_error_message(error_msg, sizeof(error_msg));
+        return send_error(sock, error_msg);
+    }
+#endif
+    return send_success(sock);
+}
+
+static int handle_close_stderr(socket_t sock) {
+    fflush(stderr);
+#ifdef _WIN32
+    if (!CloseHandle(GetStdHandle(STD_ERROR_HANDLE))) {
+        char error_msg[256];
+        get_error_message(error_msg, sizeof(error_msg));
+        return send_error(sock, error_msg);
+    }
+#else
+    g_watch_stdio[STDERR_FILENO] = 0;
     if (close(STDERR_FILENO) < 0) {
         char error_msg[256];
         get_error_message(error_msg, sizeof(error_msg));
@@ -705,131 +1000,561 @@ static int handle_is_stdin_connected(socket_t sock) {
     return write_full(sock, &connected, sizeof(connected));
 }
 
-int main(int argc, char* argv[]) {
-    g_argc = argc;
-    g_argv = argv;
+// Sent by an overloaded server instead of accepting the handshake. The
+// proxy closes the connection and connects again once the delay has passed.
+static int handle_retry_later(socket_t sock) {
+    uint32_t delay_ms;
     
-    // Get port from environment variable
-    const char* port_str = getenv("PROCESS_PROXY_PORT");
-    if (!port_str) {
-        fprintf(stderr, "Error: PROCESS_PROXY_PORT environment variable not set\n");
-        return 1;
+    if (read_full(sock, &delay_ms, sizeof(delay_ms)) < 0) {
+        return -1;
     }
     
-    int port = atoi(port_str);
-    if (port <= 0 || port > 65535) {
-        fprintf(stderr, "Error: Invalid port number in PROCESS_PROXY_PORT: %s\n", port_str);
-        return 1;
+    g_retry_delay_ms = delay_ms < MAX_RETRY_DELAY_MS ? delay_ms : MAX_RETRY_DELAY_MS;
+    
+#ifndef _WIN32
+    // Notifications pushed while the server held us back are lost with this
+    // connection. Nothing can have been closed before the first command, so
+    // watch everything again for the next connection to be told.
+    for (int fd = 0; fd < 3; fd++) {
+        g_watch_stdio[fd] = 1;
     }
+#endif
     
+    return HANDLER_RECONNECT;
+}
+
+#ifndef _WIN32
+// Writes exactly n bytes to a file descriptor
+static int write_fd_full(int fd, const void* buf, size_t len) {
+    size_t written = 0;
+    const uint8_t* ptr = (const uint8_t*)buf;
+    
+    while (written < len) {
+        ssize_t result = write(fd, ptr + written, len - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        written += result;
+    }
+    return 0;
+}
+#endif
+
+// Switches the socket to carrying raw stdin. From the success response on,
+// everything read from stdin is copied to the socket unframed and the write
+// side of the socket is shut down at EOF. The server ends the session by
+// sending a 4-byte exit code, at which point the proxy exits with that code
+// whether or not stdin has reached EOF.
+static int handle_upgrade_raw_stdin(socket_t sock) {
 #ifdef _WIN32
-    // Initialize Winsock
-    WSADATA wsa_data;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
-        fprintf(stderr, "Error: WSAStartup failed\n");
-        return 1;
+    // Stdin handles can't be waited on together with the socket
+    return send_error(sock, "Raw stdin is not supported on Windows");
+#else
+    if (send_success(sock) < 0) {
+        return -1;
     }
+    
+    int stdin_open = 1;
+#ifdef __linux__
+    // splice() moves data between a pipe and the socket without copying it
+    // through user space. It fails with EINVAL if stdin isn't a pipe, in
+    // which case we fall back to read() and send().
+    int use_splice = 1;
 #endif
     
-    // Create socket
-    g_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (g_socket == INVALID_SOCKET_VALUE) {
-        fprintf(stderr, "Error: Failed to create socket\n");
+    while (1) {
+        struct pollfd pfds[2];
+        pfds[0].fd = sock;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = stdin_open ? STDIN_FILENO : -1;
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+        
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        
+        if (pfds[0].revents) {
+            int32_t exit_code;
+            if (read_full(sock, &exit_code, sizeof(exit_code)) < 0) {
+                return -1;
+            }
+            close_socket(sock);
+            exit(exit_code);
+        }
+        
+        if (!pfds[1].revents) {
+            continue;
+        }
+        
+        ssize_t result = -1;
+#ifdef __linux__
+        if (use_splice) {
+            result = splice(STDIN_FILENO, NULL, sock, NULL, IO_ARENA_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (result < 0 && errno == EINVAL) {
+                use_splice = 0;
+            }
+        }
+        if (!use_splice)
+#endif
+        {
+            result = read(STDIN_FILENO, g_io_arena, IO_ARENA_SIZE);
+            if (result > 0 && write_full(sock, g_io_arena, (size_t)result) < 0) {
+                return -1;
+            }
+        }
+        
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            continue;
+        }
+        
+        if (result <= 0) {
+            // EOF or a broken stdin, either way there's nothing more to send
+            stdin_open = 0;
+            shutdown(sock, SHUT_WR);
+        }
+    }
+#endif
+}
+
+// Switches the socket to carrying raw stdout. From the success response on,
+// everything received on the socket is written to stdout unfiltered until the
+// server shuts down its side of the connection. The proxy then flushes
+// stdout, sends a trailer in the regular response format reporting whether
+// all of it could be written, and exits with the code given in the payload.
+static int handle_upgrade_raw_stdout(socket_t sock) {
+    int32_t exit_code;
+    
+    if (read_full(sock, &exit_code, sizeof(exit_code)) < 0) {
+        return -1;
+    }
+    
+    // Anything written through stdio so far must come first
+    fflush(stdout);
+    
+    if (send_success(sock) < 0) {
+        return -1;
+    }
+    
+    int write_failed = 0;
+    char error_msg[256];
+    
+#ifdef __linux__
+    // Moves data from the socket straight into a stdout pipe, see above
+    while (1) {
+        ssize_t result = splice(sock, NULL, STDOUT_FILENO, NULL, IO_ARENA_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (result > 0) {
+            continue;
+        }
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0 && errno != EINVAL) {
+            get_error_message(error_msg, sizeof(error_msg));
+            write_failed = 1;
+        }
+        break;
+    }
+    
+    // EINVAL leaves us at the start of the stream, copy it the slow way.
+    // After any other error this drains what's left.
+#endif
+    while (1) {
+        int result = recv(sock, (char*)g_io_arena, IO_ARENA_SIZE, 0);
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        
+        if (write_failed) {
+            // Drain the stream so the server isn't left blocked on a write
+            continue;
+        }
+        
 #ifdef _WIN32
-        WSACleanup();
+        if (fwrite(g_io_arena, 1, result, stdout) != (size_t)result || fflush(stdout) != 0) {
+#else
+        if (write_fd_full(STDOUT_FILENO, g_io_arena, result) < 0) {
 #endif
-        return 1;
+            get_error_message(error_msg, sizeof(error_msg));
+            write_failed = 1;
+        }
     }
     
-    // Connect to server
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    if (write_failed) {
+        send_error(sock, error_msg);
+    } else {
+        send_success(sock);
+    }
     
-    if (connect(g_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        fprintf(stderr, "Error: Failed to connect to localhost:%d\n", port);
-        close_socket(g_socket);
+    close_socket(sock);
+    exit(exit_code);
+    
+    return 0; // Never reached
+}
+
+static void sleep_ms(uint32_t ms) {
 #ifdef _WIN32
-        WSACleanup();
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
 #endif
-        return 1;
+}
+
+#ifndef _WIN32
+#ifdef POLLRDHUP
+    // Lets us see a socket-backed stdin being shut down by its writer
+    #define STDIN_HANGUP_EVENTS POLLRDHUP
+#else
+    #define STDIN_HANGUP_EVENTS 0
+#endif
+
+static int send_notification(socket_t sock, uint8_t event) {
+    uint8_t frame[5];
+    int32_t status = STATUS_NOTIFICATION;
+    memcpy(frame, &status, sizeof(status));
+    frame[4] = event;
+    return write_full(sock, frame, sizeof(frame));
+}
+
+static void close_channel(int fd) {
+    if (g_channels[fd] == INVALID_SOCKET_VALUE) {
+        return;
     }
     
-    // Send handshake: "ProcessProxy 0002 " (18 bytes) + token (128 bytes) = 146 bytes total
-    char handshake[146];
-    memset(handshake, 0, sizeof(handshake));
+    // Closing flushes anything still queued in the kernel before the FIN
+    close_socket(g_channels[fd]);
+    g_channels[fd] = INVALID_SOCKET_VALUE;
+    
+    if (fd == STDIN_FILENO) {
+        g_stdin_channel_off = 0;
+        g_stdin_channel_len = 0;
+    }
+}
+
+// Moves stdin into its data channel without ever blocking the command loop.
+// Called when stdin is readable while the buffer is empty, or when the
+// channel is writable while it isn't, and never otherwise as reading stdin
+// could block. Closes the channel at EOF.
+static void pump_stdin_channel(void) {
+    if (g_stdin_channel_len == 0) {
+        ssize_t result = read(STDIN_FILENO, g_stdin_channel_buf, STDIN_CHANNEL_BUFFER_SIZE);
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (result <= 0) {
+            close_channel(STDIN_FILENO);
+            return;
+        }
+        g_stdin_channel_off = 0;
+        g_stdin_channel_len = (size_t)result;
+    }
     
-    // Copy protocol header (18 bytes including trailing space)
-    memcpy(handshake, "ProcessProxy 0002 ", 18);
+    while (g_stdin_channel_len > 0) {
+        ssize_t sent = send(g_channels[STDIN_FILENO], g_stdin_channel_buf + g_stdin_channel_off, g_stdin_channel_len, CHANNEL_SEND_FLAGS);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            close_channel(STDIN_FILENO);
+            return;
+        }
+        g_stdin_channel_off += (size_t)sent;
+        g_stdin_channel_len -= (size_t)sent;
+    }
+}
+
+// Writes whatever has arrived on a stdout or stderr data channel. The server
+// ending the channel closes the stream, like CLOSE_STDOUT/CLOSE_STDERR would.
+static int pump_output_channel(socket_t sock, int fd) {
+    int result = recv(g_channels[fd], (char*)g_io_arena, IO_ARENA_SIZE, 0);
+    if (result < 0 && errno == EINTR) {
+        return 0;
+    }
+    
+    if (result <= 0) {
+        close_channel(fd);
+        g_watch_stdio[fd] = 0;
+        close(fd);
+        return 0;
+    }
+    
+    if (write_fd_full(fd, g_io_arena, (size_t)result) < 0) {
+        // The server sees the channel close, and learns why from the
+        // notification unless it has already been sent.
+        close_channel(fd);
+        if (g_watch_stdio[fd]) {
+            g_watch_stdio[fd] = 0;
+            return send_notification(sock, fd == STDOUT_FILENO ? NOTIFY_STDOUT_BROKEN : NOTIFY_STDERR_BROKEN);
+        }
+    }
     
-    // Get token from environment variable
-    const char* token_env = getenv("PROCESS_PROXY_TOKEN");
-    if (token_env != NULL) {
-        // Copy token, up to 128 bytes (remaining bytes stay as null padding)
-        size_t token_len = strlen(token_env);
-        if (token_len > 128) {
-            token_len = 128;
+    return 0;
+}
+
+static void drain_output_channels(socket_t sock) {
+    for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+        while (g_channels[fd] != INVALID_SOCKET_VALUE) {
+            if (pump_output_channel(sock, fd) < 0) {
+                return;
+            }
         }
-        memcpy(handshake + 18, token_env, token_len);
     }
-    // If token_env is NULL or empty, the token portion remains null-padded
+}
+
+// Waits for the next command to arrive on the socket, pushing notifications
+// for any standard stream that hangs up or fails in the meantime. Only hang-up
+// and error conditions are watched so idle streams never wake the loop.
+static int wait_for_command(socket_t sock) {
+    static const uint8_t notifications[3] = {
+        NOTIFY_STDIN_DISCONNECTED,
+        NOTIFY_STDOUT_BROKEN,
+        NOTIFY_STDERR_BROKEN
+    };
+    
+    while (1) {
+        // The socket, the three watched standard streams, stdin as a source
+        // for its data channel and the three data channels
+        struct pollfd pfds[8];
+        pfds[0].fd = sock;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        
+        for (int fd = 0; fd < 3; fd++) {
+            // poll() ignores negative descriptors
+            pfds[fd + 1].fd = g_watch_stdio[fd] > 0 ? fd : -1;
+            pfds[fd + 1].events = fd == STDIN_FILENO ? STDIN_HANGUP_EVENTS : 0;
+            pfds[fd + 1].revents = 0;
+        }
+        
+        int stdin_channel = g_channels[STDIN_FILENO] != INVALID_SOCKET_VALUE;
+        pfds[4].fd = stdin_channel && g_stdin_channel_len == 0 ? STDIN_FILENO : -1;
+        pfds[4].events = POLLIN;
+        pfds[4].revents = 0;
+        
+        for (int fd = 0; fd < 3; fd++) {
+            pfds[fd + 5].fd = g_channels[fd];
+            pfds[fd + 5].events = fd == STDIN_FILENO
+                ? (g_stdin_channel_len > 0 ? POLLOUT : 0)
+                : POLLIN;
+            pfds[fd + 5].revents = 0;
+        }
+        
+        if (poll(pfds, 8, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        
+        for (int fd = 0; fd < 3; fd++) {
+            short revents = pfds[fd + 1].revents;
+            
+            if (revents & POLLNVAL) {
+                // Closed by something other than us, nothing left to watch
+                g_watch_stdio[fd] = 0;
+                continue;
+            }
+            
+            if (!(revents & (POLLHUP | POLLERR | STDIN_HANGUP_EVENTS))) {
+                continue;
+            }
+            
+            if (fd == STDIN_FILENO) {
+                // The writer is gone but stdin is only disconnected once
+                // everything it wrote has been read.
+                int pending = 0;
+                if (ioctl(STDIN_FILENO, FIONREAD, &pending) == 0 && pending > 0) {
+                    g_watch_stdio[fd] = -1;
+                    continue;
+                }
+            }
+            
+            g_watch_stdio[fd] = 0;
+            if (send_notification(sock, notifications[fd]) < 0) {
+                return -1;
+            }
+        }
+        
+        if (pfds[5].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            // Reset by the server, e.g. it closed stdin with data unread. Stdin
+            // may have nothing to read, so don't go near it.
+            close_channel(STDIN_FILENO);
+        } else if (pfds[4].revents || (pfds[5].revents & POLLOUT)) {
+            pump_stdin_channel();
+        }
+        
+        for (int fd = STDOUT_FILENO; fd <= STDERR_FILENO; fd++) {
+            if (pfds[fd + 5].revents && g_channels[fd] != INVALID_SOCKET_VALUE) {
+                if (pump_output_channel(sock, fd) < 0) {
+                    return -1;
+                }
+            }
+        }
+        
+        if (pfds[0].revents) {
+            return 0;
+        }
+    }
+}
+#endif
+
+// Opens an extra connection to the server dedicated to a single standard
+// stream, identified by its file descriptor. The server authenticates it by
+// the token and the key it generated for this channel.
+static int handle_open_data_channel(socket_t sock) {
+    uint32_t fd;
+    uint8_t key[DATA_CHANNEL_KEY_LENGTH];
+    
+    if (read_full(sock, &fd, sizeof(fd)) < 0 || read_full(sock, key, sizeof(key)) < 0) {
+        return -1;
+    }
     
-    if (send(g_socket, handshake, 146, 0) != 146) {
-        fprintf(stderr, "Error: Failed to send handshake\n");
-        close_socket(g_socket);
 #ifdef _WIN32
-        WSACleanup();
+    // Stdio handles can't be waited on together with sockets
+    return send_error(sock, "Data channels are not supported on Windows");
+#else
+    if (fd > STDERR_FILENO || g_channels[fd] != INVALID_SOCKET_VALUE) {
+        return send_error(sock, "Invalid data channel");
+    }
+    
+    socket_t channel = open_socket(g_port);
+    if (channel == INVALID_SOCKET_VALUE) {
+        char error_msg[256];
+        get_error_message(error_msg, sizeof(error_msg));
+        return send_error(sock, error_msg);
+    }
+    
+    if (send_handshake(channel, DATA_CHANNEL_HEADER, key) < 0) {
+        close_socket(channel);
+        return send_error(sock, "Failed to send data channel handshake");
+    }
+    
+#ifdef SO_NOSIGPIPE
+    int nosigpipe = 1;
+    setsockopt(channel, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
 #endif
-        return 1;
+    
+    if (fd == STDIN_FILENO) {
+        // Never let a slow reader block the command loop. The channel closing
+        // takes the place of the stdin disconnected notification.
+        fcntl(channel, F_SETFL, fcntl(channel, F_GETFL) | O_NONBLOCK);
+        g_watch_stdio[STDIN_FILENO] = 0;
+    } else {
+        // Anything written through stdio so far must come first
+        fflush(fd == STDOUT_FILENO ? stdout : stderr);
+    }
+    
+    g_channels[fd] = channel;
+    return send_success(sock);
+#endif
+}
+
+// Connects to the server and sends the handshake. Returns the connected
+// socket, or INVALID_SOCKET_VALUE after printing an error.
+static socket_t connect_to_server(int port) {
+    socket_t sock = open_socket(port);
+    if (sock == INVALID_SOCKET_VALUE) {
+        fprintf(stderr, "Error: Failed to connect to localhost:%d\n", port);
+        return INVALID_SOCKET_VALUE;
+    }
+    
+    if (send_handshake(sock, HANDSHAKE_HEADER, NULL) < 0) {
+        fprintf(stderr, "Error: Failed to send handshake\n");
+        close_socket(sock);
+        return INVALID_SOCKET_VALUE;
     }
     
-    // Main command loop
+    return sock;
+}
+
+// Executes commands until the connection closes. Returns HANDLER_RECONNECT if
+// the server asked the proxy to connect again later.
+static int run_command_loop(socket_t sock) {
     while (1) {
+#ifndef _WIN32
+        if (wait_for_command(sock) < 0) {
+            return 0;
+        }
+#endif
+        
         uint8_t cmd;
-        int result = recv(g_socket, (char*)&cmd, 1, 0);
+        int result = recv(sock, (char*)&cmd, 1, 0);
         
         if (result <= 0) {
             // Connection closed or error
-            break;
+            return 0;
         }
         
         int handler_result = 0;
 
         switch (cmd) {
             case CMD_GET_ARGS:
-                handler_result = handle_get_args(g_socket);
+                handler_result = handle_get_args(sock);
                 break;
             case CMD_READ_STDIN:
-                handler_result = handle_read_stdin(g_socket);
+                handler_result = handle_read_stdin(sock);
                 break;
             case CMD_WRITE_STDOUT:
-                handler_result = handle_write_stdout(g_socket);
+                handler_result = handle_write_stdout(sock);
                 break;
             case CMD_WRITE_STDERR:
-                handler_result = handle_write_stderr(g_socket);
+                handler_result = handle_write_stderr(sock);
                 break;
             case CMD_GET_CWD:
-                handler_result = handle_get_cwd(g_socket);
+                handler_result = handle_get_cwd(sock);
                 break;
             case CMD_GET_ENV:
-                handler_result = handle_get_env(g_socket);
+                handler_result = handle_get_env(sock);
                 break;
             case CMD_EXIT:
-                handler_result = handle_exit_cmd(g_socket);
+                handler_result = handle_exit_cmd(sock);
                 break;
             case CMD_CLOSE_STDIN:
-                handler_result = handle_close_stdin(g_socket);
+                handler_result = handle_close_stdin(sock);
                 break;
             case CMD_CLOSE_STDOUT:
-                handler_result = handle_close_stdout(g_socket);
+                handler_result = handle_close_stdout(sock);
                 break;
             case CMD_CLOSE_STDERR:
-                handler_result = handle_close_stderr(g_socket);
+                handler_result = handle_close_stderr(sock);
                 break;
             case CMD_IS_STDIN_CONNECTED:
-                handler_result = handle_is_stdin_connected(g_socket);
+                handler_result = handle_is_stdin_connected(sock);
+                break;
+            case CMD_RETRY_LATER:
+                handler_result = handle_retry_later(sock);
+                break;
+            case CMD_UPGRADE_RAW_STDIN:
+                handler_result = handle_upgrade_raw_stdin(sock);
+                break;
+            case CMD_UPGRADE_RAW_STDOUT:
+                handler_result = handle_upgrade_raw_stdout(sock);
+                break;
+            case CMD_OPEN_DATA_CHANNEL:
+                handler_result = handle_open_data_channel(sock);
+                break;
+            case CMD_GET_BLOCK_DIGESTS:
+                handler_result = handle_get_block_digests(sock);
+                break;
+            case CMD_PING:
+                handler_result = handle_ping(sock);
+                break;
+            case CMD_SET_TIMESTAMPS:
+                handler_result = handle_set_timestamps(sock);
                 break;
             default:
                 // Unknown command, close connection
@@ -837,16 +1562,72 @@ int main(int argc, char* argv[]) {
                 break;
         }
         
-        if (handler_result < 0) {
+        if (handler_result != 0) {
+            return handler_result;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    g_argc = argc;
+    g_argv = argv;
+    
+    // Get port from environment variable
+    const char* port_str = getenv("PROCESS_PROXY_PORT");
+    if (!port_str) {
+        fprintf(stderr, "Error: PROCESS_PROXY_PORT environment variable not set\n");
+        return 1;
+    }
+    
+    int port = atoi(port_str);
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Error: Invalid port number in PROCESS_PROXY_PORT: %s\n", port_str);
+        return 1;
+    }
+    g_port = port;
+    
+#ifdef _WIN32
+    // Initialize Winsock
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        fprintf(stderr, "Error: WSAStartup failed\n");
+        return 1;
+    }
+#else
+    // Writing to a stdout, stderr or socket whose reader has gone away must
+    // fail with EPIPE and be reported rather than kill the proxy
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    
+    int exit_code = 0;
+    
+    for (int attempt = 1; ; attempt++) {
+        g_socket = connect_to_server(port);
+        if (g_socket == INVALID_SOCKET_VALUE) {
+            exit_code = 1;
+            break;
+        }
+        
+        int result = run_command_loop(g_socket);
+        close_socket(g_socket);
+        g_socket = INVALID_SOCKET_VALUE;
+        
+        if (result != HANDLER_RECONNECT) {
             break;
         }
+        
+        if (attempt == MAX_CONNECT_ATTEMPTS) {
+            fprintf(stderr, "Error: Server at localhost:%d is overloaded\n", port);
+            exit_code = 1;
+            break;
+        }
+        
+        sleep_ms(g_retry_delay_ms);
     }
     
-    // Cleanup
-    close_socket(g_socket);
 #ifdef _WIN32
     WSACleanup();
 #endif
     
-    return 0;
+    return exit_code;
 }
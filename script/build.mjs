@@ -62,6 +62,13 @@ for (const arch of archs) {
         } else {
           console.log(`Build succeeded for architecture: ${arch}`)
           await copyFile(join('build', 'Release', filename), destination)
+
+          // The framing addon is optional, the server falls back to
+          // JavaScript without it.
+          const addon = `process-proxy-framing-${process.platform}-${arch}.node`
+          if (await pathExists(join('build', 'Release', addon))) {
+            await copyFile(join('build', 'Release', addon), join('bin', addon))
+          }
           resolve()
         }
       })
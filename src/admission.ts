@@ -0,0 +1,240 @@
+import { Socket } from 'net'
+import { performance } from 'perf_hooks'
+
+const DEFAULT_MAX_QUEUED = 64
+const DEFAULT_QUEUE_TIMEOUT = 5000
+const DEFAULT_RETRY_AFTER = 250
+const DEFAULT_SAMPLE_INTERVAL = 50
+
+export interface AdmissionControllerOptions {
+  /** Maximum number of live connections. Defaults to no limit. */
+  maxConnections?: number
+  /**
+   * Event loop lag in milliseconds above which the server counts as
+   * overloaded. Defaults to no limit.
+   */
+  maxEventLoopLag?: number
+  /**
+   * Bytes buffered in the sockets of live connections above which the server
+   * counts as overloaded. Defaults to no limit.
+   */
+  maxBufferedBytes?: number
+  /**
+   * Number of handshakes held back while overloaded before further ones are
+   * turned away. Defaults to 64.
+   */
+  maxQueued?: number
+  /**
+   * Milliseconds a handshake may wait in the queue before it's turned away.
+   * Defaults to 5000.
+   */
+  queueTimeout?: number
+  /**
+   * Milliseconds a turned away proxy is told to wait before connecting again.
+   * Defaults to 250.
+   */
+  retryAfter?: number
+  /** Milliseconds between event loop lag samples. Defaults to 50. */
+  sampleInterval?: number
+}
+
+interface QueuedHandshake {
+  socket: Socket
+  timer: NodeJS.Timeout
+  settle: (admitted: boolean) => void
+}
+
+/**
+ * Decides whether a server accepts new connections.
+ *
+ * While the server is overloaded, i.e. it has too many live connections, its
+ * event loop is lagging or too much data is buffered in its sockets, new
+ * handshakes wait in a bounded FIFO queue and are admitted in order as load
+ * drops. Handshakes that don't fit in the queue, or wait in it for too long,
+ * are turned away and the proxy is asked to retry after `retryAfter`
+ * milliseconds. Connections that are already established are unaffected.
+ */
+export class AdmissionController {
+  public readonly maxConnections: number
+  public readonly maxEventLoopLag: number
+  public readonly maxBufferedBytes: number
+  public readonly maxQueued: number
+  public readonly queueTimeout: number
+  public readonly retryAfter: number
+  public readonly sampleInterval: number
+
+  private readonly live = new Set<Socket>()
+  private readonly channels = new Set<Socket>()
+  private readonly queue: QueuedHandshake[] = []
+  private sampler: NodeJS.Timeout | undefined
+  private lag = 0
+
+  /** Number of handshakes admitted */
+  public admitted = 0
+  /** Number of handshakes that had to wait in the queue */
+  public queued = 0
+  /** Number of handshakes turned away */
+  public rejected = 0
+
+  constructor(options?: AdmissionControllerOptions) {
+    this.maxConnections = options?.maxConnections ?? Infinity
+    this.maxEventLoopLag = options?.maxEventLoopLag ?? Infinity
+    this.maxBufferedBytes = options?.maxBufferedBytes ?? Infinity
+    this.maxQueued = options?.maxQueued ?? DEFAULT_MAX_QUEUED
+    this.queueTimeout = options?.queueTimeout ?? DEFAULT_QUEUE_TIMEOUT
+    this.retryAfter = options?.retryAfter ?? DEFAULT_RETRY_AFTER
+    this.sampleInterval = options?.sampleInterval ?? DEFAULT_SAMPLE_INTERVAL
+  }
+
+  /** Number of admitted connections that haven't closed yet */
+  public get connections() {
+    return this.live.size
+  }
+
+  /** Number of open data channels belonging to admitted connections */
+  public get dataChannels() {
+    return this.channels.size
+  }
+
+  /** Number of handshakes currently waiting in the queue */
+  public get pending() {
+    return this.queue.length
+  }
+
+  /** Most recently sampled event loop lag in milliseconds */
+  public get eventLoopLag() {
+    return this.lag
+  }
+
+  /** Bytes buffered in the sockets of live connections and their channels */
+  public get bufferedBytes() {
+    let bytes = 0
+    for (const sockets of [this.live, this.channels]) {
+      for (const socket of sockets) {
+        bytes += socket.writableLength + socket.readableLength
+      }
+    }
+    return bytes
+  }
+
+  public get overloaded(): boolean {
+    return (
+      this.live.size >= this.maxConnections ||
+      this.lag > this.maxEventLoopLag ||
+      (this.maxBufferedBytes !== Infinity &&
+        this.bufferedBytes > this.maxBufferedBytes)
+    )
+  }
+
+  /**
+   * Resolves with true once the socket may proceed with its handshake, from
+   * then on it counts as a live connection until it closes. Resolves with
+   * false if the socket was turned away or closed while waiting.
+   */
+  public admit(socket: Socket): Promise<boolean> {
+    if (!this.overloaded && this.queue.length === 0) {
+      this.add(socket)
+      return Promise.resolve(true)
+    }
+
+    if (this.queue.length >= this.maxQueued) {
+      this.rejected++
+      return Promise.resolve(false)
+    }
+
+    this.queued++
+
+    return new Promise<boolean>((resolve) => {
+      const entry: QueuedHandshake = {
+        socket,
+        timer: setTimeout(() => {
+          this.rejected++
+          entry.settle(false)
+        }, this.queueTimeout),
+        settle: (admitted) => {
+          clearTimeout(entry.timer)
+          socket.off('close', onClose)
+          this.queue.splice(this.queue.indexOf(entry), 1)
+          if (admitted) {
+            this.add(socket)
+          }
+          resolve(admitted)
+        },
+      }
+      const onClose = () => entry.settle(false)
+
+      socket.once('close', onClose)
+      this.queue.push(entry)
+      this.startSampling()
+    })
+  }
+
+  /**
+   * Counts a data channel of an admitted connection towards the bytes
+   * buffered until it closes. Channels are never held back or turned away,
+   * their connection has already been admitted and is waiting for them, and
+   * they don't count as connections of their own.
+   */
+  public addDataChannel(socket: Socket) {
+    this.channels.add(socket)
+    socket.once('close', () => {
+      this.channels.delete(socket)
+      this.drain()
+    })
+  }
+
+  private add(socket: Socket) {
+    this.admitted++
+    this.live.add(socket)
+    socket.once('close', () => {
+      this.live.delete(socket)
+      this.drain()
+    })
+    this.startSampling()
+  }
+
+  /** Admits queued handshakes in order for as long as load allows */
+  private drain() {
+    while (this.queue.length > 0 && !this.overloaded) {
+      this.queue[0].settle(true)
+    }
+  }
+
+  // Lag needs watching while there are connections to protect, and queued
+  // handshakes are re-checked on every sample since buffered bytes drain
+  // without any event to hook into.
+  private get needsSampling() {
+    return (
+      this.queue.length > 0 ||
+      (this.maxEventLoopLag !== Infinity && this.live.size > 0)
+    )
+  }
+
+  // Lag is measured as the delay of a timer beyond its due time. The timer
+  // never keeps the process alive.
+  private startSampling() {
+    if (!this.sampler && this.needsSampling) {
+      this.schedule(performance.now())
+    }
+  }
+
+  private schedule(from: number) {
+    const due = from + this.sampleInterval
+    this.sampler = setTimeout(() => this.sample(due), this.sampleInterval)
+    this.sampler.unref()
+  }
+
+  private sample(due: number) {
+    const now = performance.now()
+    this.sampler = undefined
+    this.lag = Math.max(0, now - due)
+
+    this.drain()
+
+    if (this.needsSampling) {
+      this.schedule(now)
+    } else {
+      this.lag = 0
+    }
+  }
+}
@@ -0,0 +1,104 @@
+const DEFAULT_SLAB_SIZE = 2 * 1024 * 1024
+const DEFAULT_MAX_FREE_SLABS = 4
+
+// Keeps slices 8-byte aligned, like Node's own buffer pool
+const align = (offset: number) => (offset + 7) & ~7
+
+interface Slab {
+  buffer: Buffer
+  offset: number
+  leases: number
+}
+
+/**
+ * Hands out buffers sliced from large slabs that are recycled once every
+ * slice has been released, so bulk transfers don't allocate (and later
+ * collect) a separate backing store for every payload.
+ *
+ * Releasing is optional. A slab with slices that are never released is
+ * simply garbage collected along with its last slice, so buffers may be kept
+ * as long as they're not released. A released buffer must not be used again,
+ * copy it first if it needs to be kept. Releasing a buffer twice or releasing
+ * one that didn't come from the pool does nothing.
+ */
+export class BufferPool {
+  public readonly slabSize: number
+  public readonly maxFreeSlabs: number
+
+  /** Number of slabs allocated */
+  public slabsAllocated = 0
+  /** Number of times a slab was reused after all its slices were released */
+  public slabsRecycled = 0
+
+  private current: Slab | undefined
+  private readonly free: Slab[] = []
+  private readonly slabs = new WeakMap<ArrayBufferLike, Slab>()
+  private readonly leased = new WeakSet<Buffer>()
+
+  /**
+   * @param slabSize Size of each slab in bytes, buffers larger than half of
+   * it are allocated on their own. Defaults to 2MB.
+   * @param maxFreeSlabs Number of fully released slabs kept for reuse.
+   * Defaults to 4.
+   */
+  constructor(
+    slabSize = DEFAULT_SLAB_SIZE,
+    maxFreeSlabs = DEFAULT_MAX_FREE_SLABS,
+  ) {
+    this.slabSize = slabSize
+    this.maxFreeSlabs = maxFreeSlabs
+  }
+
+  /** Returns an uninitialized buffer of the given length */
+  public alloc(length: number): Buffer {
+    if (length === 0 || length > this.slabSize / 2) {
+      return Buffer.allocUnsafe(length)
+    }
+
+    let slab = this.current
+    if (!slab || slab.offset + length > slab.buffer.length) {
+      slab = this.nextSlab()
+    }
+
+    const buffer = slab.buffer.subarray(slab.offset, slab.offset + length)
+    slab.offset = align(slab.offset + length)
+    slab.leases++
+    this.leased.add(buffer)
+    return buffer
+  }
+
+  /** Returns a buffer from alloc() to the pool */
+  public release(buffer: Buffer) {
+    if (!this.leased.delete(buffer)) {
+      return
+    }
+
+    const slab = this.slabs.get(buffer.buffer)
+    if (!slab || --slab.leases > 0) {
+      return
+    }
+
+    // Nothing refers to the slab's contents anymore, start over from the top
+    slab.offset = 0
+    if (slab !== this.current && this.free.length < this.maxFreeSlabs) {
+      this.free.push(slab)
+    }
+  }
+
+  private nextSlab(): Slab {
+    // The current slab still has slices out, it goes back to the free list
+    // once they've all been released.
+    let slab = this.free.pop()
+    if (slab) {
+      this.slabsRecycled++
+    } else {
+      const buffer = Buffer.allocUnsafeSlow(this.slabSize)
+      slab = { buffer, offset: 0, leases: 0 }
+      this.slabs.set(buffer.buffer, slab)
+      this.slabsAllocated++
+    }
+
+    this.current = slab
+    return slab
+  }
+}
@@ -0,0 +1,160 @@
+import type { ChildProcess } from 'child_process'
+import { constants } from 'os'
+import type { Readable, Writable } from 'stream'
+import { finished } from 'stream/promises'
+import { getSystemErrorName } from 'util'
+import type { ProcessProxyConnection } from './connection.js'
+import type { DataChannelStream } from './data-channel.js'
+
+/**
+ * How a child process is connected to the proxy. With data channels its
+ * output is written to, and its input read from, dedicated sockets without
+ * any framing or per-read round trips. Otherwise everything goes over the
+ * command socket.
+ */
+export type ChildProcessTransport = 'data-channels' | 'framed'
+
+export interface PipeChildProcessOptions {
+  /**
+   * Forward over the command socket even when data channels are available,
+   * e.g. to keep the connection migratable.
+   */
+  framed?: boolean
+}
+
+export interface PipeChildProcessResult {
+  transport: ChildProcessTransport
+  /** Exit code the proxy exited with */
+  exitCode: number
+}
+
+const stdio: DataChannelStream[] = ['stdin', 'stdout', 'stderr']
+
+// Shells report a process killed by a signal as 128 plus the signal number
+const exitCodeOf = (code: number | null, signal: NodeJS.Signals | null) =>
+  code ?? 128 + (signal ? (constants.signals[signal] ?? 0) : 0)
+
+const hasExited = (child: ChildProcess) =>
+  child.exitCode !== null || child.signalCode !== null
+
+// pipe() never ends the target for a source that has already ended
+const forward = (source: Readable, target: Writable) => {
+  if (source.readableEnded || source.destroyed) {
+    target.end()
+  } else {
+    source.pipe(target)
+  }
+}
+
+const spawned = (child: ChildProcess) =>
+  new Promise<void>((resolve, reject) => {
+    // The pid is only assigned once the child has been spawned successfully
+    if (child.pid !== undefined) {
+      return resolve()
+    }
+
+    // Failed before we got to listen, the exit code is the negated errno
+    if (hasExited(child)) {
+      const code = getSystemErrorName(child.exitCode ?? 0)
+      const error: NodeJS.ErrnoException = new Error(
+        `spawn ${child.spawnfile} ${code}`,
+      )
+      return reject(Object.assign(error, { errno: child.exitCode, code }))
+    }
+
+    const onSpawn = () => {
+      child.off('error', onError)
+      resolve()
+    }
+    const onError = (error: Error) => {
+      child.off('spawn', onSpawn)
+      reject(error)
+    }
+    child.once('spawn', onSpawn).once('error', onError)
+  })
+
+// Resolves with the exit code once the child has exited and its stdio has
+// closed. 'close' has already been emitted, and won't be again, for a child
+// that exited before it was handed over, so wait for its streams instead.
+const closed = (child: ChildProcess) =>
+  new Promise<number>((resolve) => {
+    const done = () => resolve(exitCodeOf(child.exitCode, child.signalCode))
+    if (!hasExited(child)) {
+      child.once('close', done)
+      return
+    }
+
+    const streams = child.stdio.filter((stream) => stream !== null)
+    Promise.all(streams.map((stream) => finished(stream).catch(() => {})))
+      .then(done)
+  })
+
+/**
+ * Connects a proxy to a locally spawned child process, forwarding the proxy's
+ * stdin to the child and the child's stdout and stderr back, and exits the
+ * proxy with the child's exit code once the child has exited and its output
+ * has been written. The child is killed if the proxy disconnects first.
+ *
+ * Moves the streams onto data channels when the proxy supports them (see
+ * ProcessProxyConnection.openDataChannels) and falls back to the command
+ * socket otherwise. Raw passthrough isn't used since it only carries one
+ * direction. Streams the child wasn't spawned with a pipe for are left
+ * alone. Must be called before anything has been read from the connection's
+ * stdin. Rejects without touching the connection if the child fails to
+ * spawn. The child may be passed in at any point after spawn(), including
+ * after it has exited.
+ */
+export async function pipeChildProcess(
+  connection: ProcessProxyConnection,
+  child: ChildProcess,
+  options?: PipeChildProcessOptions,
+): Promise<PipeChildProcessResult> {
+  await spawned(child)
+
+  const exited = closed(child)
+  // Errors after spawning, e.g. failing to kill the child, are of no
+  // consequence here but would otherwise crash the process
+  const ignore = () => {}
+  child.on('error', ignore)
+  const streams = stdio.filter((name) => child[name])
+
+  if (!options?.framed && connection.protocolVersion >= 6) {
+    // Not fatal, e.g. Windows proxies don't support data channels
+    await connection.openDataChannels(streams).catch(() => {})
+  }
+  const transport: ChildProcessTransport =
+    connection.channelStreams.length > 0 ? 'data-channels' : 'framed'
+
+  const kill = () => child.kill()
+  connection.once('close', kill)
+
+  if (child.stdin && !child.stdin.destroyed) {
+    // The child may exit without reading all of its input
+    child.stdin.on('error', () => {})
+    connection.stdin.pipe(child.stdin)
+  }
+  if (child.stdout) {
+    forward(child.stdout, connection.stdout)
+  }
+  if (child.stderr) {
+    forward(child.stderr, connection.stderr)
+  }
+
+  const exitCode = await exited
+  connection.off('close', kill)
+  child.off('error', ignore)
+  connection.stdin.unpipe()
+
+  const output = [
+    child.stdout && connection.stdout,
+    child.stderr && connection.stderr,
+  ]
+  await Promise.all(
+    output.map((stream) => stream && finished(stream).catch(() => {})),
+  )
+
+  if (!connection.closed) {
+    await connection.exit(exitCode)
+  }
+  return { transport, exitCode }
+}
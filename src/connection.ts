@@ -1,9 +1,28 @@
+import { randomBytes } from 'crypto'
 import { EventEmitter } from 'events'
 import { Socket } from 'net'
+import { PassThrough, type Readable, type Writable } from 'stream'
 import { ReadStream } from './read-stream.js'
 import { WriteStream } from './write-stream.js'
-import { promisify } from 'util'
-import { readSocket } from './read-socket.js'
+import {
+  CommandDispatcher,
+  type CommandOptions,
+  RESPONSE_BYTES,
+  RESPONSE_INT32,
+  RESPONSE_NONE,
+  RESPONSE_STRING,
+  RESPONSE_STRING_LIST,
+} from './dispatcher.js'
+import { PollScheduler } from './poll-scheduler.js'
+import type { DataChannelRegistry, DataChannelStream } from './data-channel.js'
+import { digestStringList, type InternCache } from './intern-cache.js'
+import { jsFraming, type Framing } from './framing.js'
+import type { BufferPool } from './buffer-pool.js'
+import {
+  LatencyTracker,
+  type ProcessProxyLatency,
+  type ProcessProxyPing,
+} from './latency.js'
 
 const GET_ARGS = 0x01
 const READ_STDIN = 0x02
@@ -16,6 +35,27 @@ const CLOSE_STDIN = 0x09
 const CLOSE_STDOUT = 0x0a
 const CLOSE_STDERR = 0x0b
 const IS_STDIN_CONNECTED = 0x0c
+const UPGRADE_RAW_STDIN = 0x0e
+const UPGRADE_RAW_STDOUT = 0x0f
+const OPEN_DATA_CHANNEL = 0x10
+const GET_BLOCK_DIGESTS = 0x11
+const PING = 0x12
+const SET_TIMESTAMPS = 0x13
+
+// Flags for SET_TIMESTAMPS
+const STAMP_STDIN = 0x01
+const STAMP_STDOUT = 0x02
+
+// Notifications pushed by protocol 0003 proxies
+const NOTIFY_STDIN_DISCONNECTED = 0x01
+const NOTIFY_STDOUT_BROKEN = 0x02
+const NOTIFY_STDERR_BROKEN = 0x03
+
+const notificationEvents: Record<number, string> = {
+  [NOTIFY_STDIN_DISCONNECTED]: 'stdin-disconnected',
+  [NOTIFY_STDOUT_BROKEN]: 'stdout-broken',
+  [NOTIFY_STDERR_BROKEN]: 'stderr-broken',
+}
 
 type Command =
   | typeof GET_ARGS
@@ -29,11 +69,12 @@ type Command =
   | typeof CLOSE_STDOUT
   | typeof CLOSE_STDERR
   | typeof IS_STDIN_CONNECTED
-
-type CommandOptions<T = void> = {
-  onBeforeSend?: () => Promise<void>
-  onConnectionClosed?: () => Promise<T>
-}
+  | typeof UPGRADE_RAW_STDIN
+  | typeof UPGRADE_RAW_STDOUT
+  | typeof OPEN_DATA_CHANNEL
+  | typeof GET_BLOCK_DIGESTS
+  | typeof PING
+  | typeof SET_TIMESTAMPS
 
 type CloseStreamCommand =
   | typeof CLOSE_STDIN
@@ -42,41 +83,167 @@ type CloseStreamCommand =
 
 type WriteStreamCommand = typeof WRITE_STDOUT | typeof WRITE_STDERR
 
+const streamNames = {
+  [CLOSE_STDIN]: 'stdin',
+  [CLOSE_STDOUT]: 'stdout',
+  [CLOSE_STDERR]: 'stderr',
+} as const
+
+const streamFds: Record<DataChannelStream, number> = {
+  stdin: 0,
+  stdout: 1,
+  stderr: 2,
+}
+
 const destroyIfNecessary = (...streams: (WriteStream | ReadStream)[]) => {
   streams.filter((x) => !x.destroyed).forEach((x) => x.destroy())
 }
 
-const buf = (length: number, fn: (buf: Buffer) => void) => {
-  const buf = Buffer.alloc(length)
-  fn(buf)
-  return buf
+export interface ProcessProxyConnectionOptions {
+  /**
+   * Scheduler used to coalesce stdin polling with other connections. Defaults
+   * to a scheduler shared by all connections in the process.
+   */
+  pollScheduler?: PollScheduler
+  /**
+   * Protocol version announced by the proxy in its handshake. Defaults to the
+   * latest version.
+   */
+  protocolVersion?: number
+  /**
+   * Registry that pairs incoming data channels with this connection, required
+   * for openDataChannels(). Provided by createProxyProcessServer.
+   */
+  dataChannels?: DataChannelRegistry
+  /**
+   * Cache sharing argument and environment blocks with other connections.
+   * getArgs() and getEnv() then return frozen objects.
+   */
+  intern?: InternCache
+  /**
+   * Pool that payloads spanning several socket reads are reassembled into,
+   * shared with other connections. Stdin chunks can be handed back with
+   * stdin.release(). By default every payload gets its own buffer.
+   */
+  bufferPool?: BufferPool
+  /**
+   * Encodes commands and decodes argument and environment blocks, either
+   * jsFraming (the default) or nativeFraming when the addon is available.
+   */
+  framing?: Framing
+}
+
+/**
+ * Everything needed to carry on a connection in another process. Plain JSON
+ * so that it can be sent over an IPC channel along with the socket handle.
+ */
+export interface ProcessProxyConnectionState {
+  token: string
+  protocolVersion: number
+  stats: ProcessProxyConnectionStats
+  stdin: 'open' | 'ended' | 'closed'
+  stdout: 'open' | 'closed'
+  stderr: 'open' | 'closed'
+  /** Base64 encoded stdin data that was read but not yet consumed */
+  pendingStdin: string
+  /** Base64 encoded bytes received from the proxy but not yet parsed */
+  pendingData: string
+  /** Which responses the proxy stamps, see enableLatencyProbes() */
+  timestamps: number
+}
+
+export interface DetachedConnection {
+  socket: Socket
+  state: ProcessProxyConnectionState
+}
+
+export interface ProcessProxyConnectionStats {
+  /** Number of commands sent to the proxy */
+  commands: number
+  /** Bytes read from the proxy's stdin */
+  stdinBytes: number
+  /** Bytes written to the proxy's stdout */
+  stdoutBytes: number
+  /** Bytes written to the proxy's stderr */
+  stderrBytes: number
+  /** Number of bytes currently requested per stdin read */
+  stdinReadSize: number
 }
-const uint8 = (num: number) => buf(1, (b) => b.writeUInt8(num, 0))
-const uint32 = (num: number) => buf(4, (b) => b.writeUInt32LE(num, 0))
-const int32 = (num: number) => buf(4, (b) => b.writeInt32LE(num, 0))
 
 export class ProcessProxyConnection extends EventEmitter {
   public readonly stdin: ReadStream
   public readonly stdout: WriteStream
   public readonly stderr: WriteStream
 
-  private queue: Promise<unknown> = Promise.resolve()
-
-  private hasSentExit: boolean = false
-  private write: (buf: Buffer) => Promise<void>
+  public readonly protocolVersion: number
+
+  private readonly dispatcher: CommandDispatcher
+  private readonly dataChannels: DataChannelRegistry | undefined
+  private readonly intern: InternCache | undefined
+  private readonly framing: Framing
+  private blockDigests: Promise<Buffer | null> | undefined
+  private readonly channels = new Map<DataChannelStream, Socket>()
+  private readonly closedStreams = new Set<CloseStreamCommand>()
+  private detached = false
+  private raw: 'stdin' | 'stdout' | undefined
+  private rawExitCode = 0
+  private rawTrailer: Promise<void> | undefined
+  private readonly latencyTracker = new LatencyTracker()
+  private timestamps = 0
+
+  private readonly onClose = () => this.handleClose()
+  private readonly onError = (error: Error) => this.handleError(error)
 
   public get closed(): boolean {
-    return this.socket.closed
+    return this.socket.closed || this.detached
+  }
+
+  public get stats(): ProcessProxyConnectionStats {
+    return {
+      commands: this.dispatcher.commandsSent,
+      stdinBytes: this.stdin.bytesRead,
+      stdoutBytes: this.stdout.bytesWritten,
+      stderrBytes: this.stderr.bytesWritten,
+      stdinReadSize: this.stdin.readSize,
+    }
+  }
+
+  /**
+   * False for connections that can't be detached: closed ones and those with
+   * data channels or raw passthrough.
+   */
+  public get migratable(): boolean {
+    return !this.closed && this.channels.size === 0 && !this.raw
+  }
+
+  /** Streams carried over data channels, see openDataChannels() */
+  public get channelStreams(): DataChannelStream[] {
+    return [...this.channels.keys()]
+  }
+
+  /**
+   * Latency broken down by leg, undefined until the proxy has been pinged.
+   * Stdin and stdout legs are only sampled while latency probes are enabled.
+   */
+  public get latency(): ProcessProxyLatency | undefined {
+    return this.latencyTracker.latency
   }
 
   constructor(
     private readonly socket: Socket,
     public readonly token: string,
+    options?: ProcessProxyConnectionOptions,
   ) {
     super()
+    this.protocolVersion = options?.protocolVersion ?? 8
+    this.dataChannels = options?.dataChannels
+    this.intern = options?.intern
+    this.framing = options?.framing ?? jsFraming
     this.stdin = new ReadStream(
       this.readStdin.bind(this),
       this.closeStream.bind(this, CLOSE_STDIN),
+      options?.pollScheduler,
+      options?.bufferPool,
     )
     this.stdout = new WriteStream(
       this.writeStream.bind(this, WRITE_STDOUT),
@@ -87,133 +254,575 @@ export class ProcessProxyConnection extends EventEmitter {
       this.closeStream.bind(this, CLOSE_STDERR),
     )
 
-    this.socket.on('close', this.handleClose.bind(this))
-    this.socket.on('error', this.handleError.bind(this))
+    // Every command is a small request awaiting a response, Nagle's algorithm
+    // would only delay them.
+    this.socket.setNoDelay(true)
 
-    this.write = promisify(this.socket.write.bind(this.socket))
+    this.dispatcher = new CommandDispatcher(
+      this.socket,
+      EXIT,
+      this.handleNotification.bind(this),
+      options?.bufferPool,
+      this.framing,
+    )
+
+    this.socket.on('close', this.onClose)
+    this.socket.on('error', this.onError)
   }
 
-  private closeStream(cmd: CloseStreamCommand) {
-    return this.send(cmd, [], { onConnectionClosed: () => Promise.resolve() })
+  /**
+   * Recreates a connection from a socket and the state returned by detach(),
+   * typically in another worker process.
+   */
+  public static attach(
+    socket: Socket,
+    state: ProcessProxyConnectionState,
+    options?: Omit<ProcessProxyConnectionOptions, 'protocolVersion'>,
+  ): ProcessProxyConnection {
+    const connection = new ProcessProxyConnection(socket, state.token, {
+      ...options,
+      protocolVersion: state.protocolVersion,
+    })
+    connection.restore(state)
+    return connection
   }
 
-  private handleClose(): void {
-    destroyIfNecessary(this.stdin, this.stdout, this.stderr)
-    this.emit('close')
+  private restore(state: ProcessProxyConnectionState) {
+    const { stats } = state
+    this.dispatcher.commandsSent = stats.commands
+    this.stdin.bytesRead = stats.stdinBytes
+    this.stdin.readSize = stats.stdinReadSize
+    this.stdout.bytesWritten = stats.stdoutBytes
+    this.stderr.bytesWritten = stats.stderrBytes
+    this.timestamps = state.timestamps
+
+    const pendingStdin = Buffer.from(state.pendingStdin, 'base64')
+    if (pendingStdin.length > 0) {
+      this.stdin.unshift(pendingStdin)
+    }
+
+    if (state.stdin === 'ended') {
+      this.stdin.push(null)
+    }
+
+    // Streams closed before the migration were closed in the proxy too
+    const closed: [WriteStream | ReadStream, CloseStreamCommand][] = [
+      [this.stdin, CLOSE_STDIN],
+      [this.stdout, CLOSE_STDOUT],
+      [this.stderr, CLOSE_STDERR],
+    ]
+    for (const [stream, cmd] of closed) {
+      if (state[streamNames[cmd]] === 'closed') {
+        this.closedStreams.add(cmd)
+        stream.destroy()
+      }
+    }
+
+    // Defer parsing until listeners have been attached, so notifications
+    // received before the migration aren't lost.
+    const pendingData = Buffer.from(state.pendingData, 'base64')
+    process.nextTick(() => this.dispatcher.restore(pendingData))
   }
 
-  private handleError(error: Error): void {
-    this.emit('error', error)
+  /**
+   * Detaches the connection from its socket so that it can be carried on in
+   * another process, see ProcessProxyConnection.attach.
+   *
+   * Emits 'detaching' and then waits until no command is in flight and the
+   * stdout and stderr streams have flushed, stops polling stdin and hands
+   * over any stdin data that hasn't been consumed. Writes made after
+   * 'detaching' has been emitted may fail. The connection emits 'detached'
+   * once done, after which it's closed and its streams are destroyed.
+   * Connections with data channels or raw passthrough can't be detached.
+   */
+  public async detach(): Promise<DetachedConnection> {
+    if (this.closed) {
+      throw new Error('Connection closed')
+    }
+    if (this.channels.size > 0) {
+      throw new Error('Connections with data channels cannot be migrated')
+    }
+    if (this.raw) {
+      throw new Error(`Connections with raw ${this.raw} cannot be migrated`)
+    }
+
+    this.stdin.suspend()
+    this.emit('detaching')
+    await this.quiesce()
+
+    const stats = this.stats
+    const stdin = this.stdin.destroyed
+      ? 'closed'
+      : this.stdin.eof
+        ? 'ended'
+        : 'open'
+    const stdout = this.stdout.destroyed ? 'closed' : 'open'
+    const stderr = this.stderr.destroyed ? 'closed' : 'open'
+
+    this.socket.off('close', this.onClose)
+    this.socket.off('error', this.onError)
+
+    // The dispatcher pauses the socket, so anything arriving from now on is
+    // buffered by it until the socket is handed over.
+    const pending = [this.dispatcher.detach('Connection migrated')]
+    for (let chunk: Buffer | null; (chunk = this.socket.read()) !== null; ) {
+      pending.push(chunk)
+    }
+
+    // Unconsumed stdin moves along with the connection rather than being
+    // emitted to whoever is still listening here.
+    const pendingStdin = this.takeBufferedStdin()
+
+    this.detached = true
+    destroyIfNecessary(this.stdin, this.stdout, this.stderr)
+    this.emit('detached')
+
+    return {
+      socket: this.socket,
+      state: {
+        token: this.token,
+        protocolVersion: this.protocolVersion,
+        stats,
+        stdin,
+        stdout,
+        stderr,
+        pendingStdin: pendingStdin.toString('base64'),
+        pendingData: Buffer.concat(pending).toString('base64'),
+        timestamps: this.timestamps,
+      },
+    }
   }
 
-  private async read<T>(length: number, fn: (buf: Buffer) => T): Promise<T> {
-    return fn(await readSocket(this.socket, length))
+  /**
+   * Waits until no command is in flight and the stdout and stderr streams have
+   * handed all buffered writes to the proxy. Stdin must have been suspended
+   * by the caller, or it would keep the connection busy.
+   */
+  private async quiesce() {
+    const flushed = (stream: WriteStream) =>
+      stream.writableLength === 0 && (!stream.writableEnded || stream.destroyed)
+
+    while (
+      !this.dispatcher.idle ||
+      !flushed(this.stdout) ||
+      !flushed(this.stderr)
+    ) {
+      await this.dispatcher.whenIdle()
+      // Give streams a chance to hand buffered writes to the dispatcher
+      await new Promise((resolve) => setImmediate(resolve))
+    }
+
+    if (this.closed || this.dispatcher.exited) {
+      throw new Error('Connection closed')
+    }
   }
 
-  private readString = (length: number) =>
-    this.read(length, (buf) => buf.toString('utf8'))
+  /**
+   * Removes and returns stdin data that has been read but not consumed,
+   * without emitting it to the stream's 'data' listeners.
+   */
+  private takeBufferedStdin(): Buffer {
+    this.stdin.unpipe()
+    this.stdin.pause()
+
+    // read() emits what it returns, so hold the listeners off meanwhile
+    const listeners = this.stdin.rawListeners('data')
+    this.stdin.removeAllListeners('data')
+    const chunks: Buffer[] = []
+    for (let chunk: Buffer | null; (chunk = this.stdin.read()) !== null; ) {
+      chunks.push(chunk)
+    }
+    for (const listener of listeners) {
+      this.stdin.on('data', listener as (chunk: Buffer) => void)
+    }
 
-  private readLengthPrefixedString = () =>
-    this.readUInt32LE().then(this.readString)
+    return Buffer.concat(chunks)
+  }
 
-  private readUInt32LE = () => this.read(4, (buf) => buf.readUInt32LE(0))
-  private readInt32LE = () => this.read(4, (buf) => buf.readInt32LE(0))
+  /**
+   * Switches the socket to carrying the proxy's stdin as raw, unframed bytes,
+   * removing all per-read round trips.
+   *
+   * Resolves with a stream of the proxy's stdin from then on (starting with
+   * anything connection.stdin had buffered) which ends when stdin does. The
+   * session is ended by calling exit(), which works whether or not stdin has
+   * ended and even if the stream has been destroyed. No other commands can be
+   * sent and the connection's own streams are destroyed. Requires protocol
+   * version 5 and isn't supported by Windows executables.
+   */
+  public async upgradeStdin(): Promise<Readable> {
+    const leftover = await this.upgrade(UPGRADE_RAW_STDIN, undefined, 'stdin')
+    const buffered = this.takeBufferedStdin()
+    destroyIfNecessary(this.stdin, this.stdout, this.stderr)
 
-  private async readStdin(maxBytes: number): Promise<Buffer | null> {
-    return this.invoke(READ_STDIN, [uint32(maxBytes)], async () => {
-      const available = await this.readInt32LE()
-      // -1: stdin closed, 0: no data available
-      if (available <= 0) {
-        return available === 0 ? Buffer.alloc(0) : null
-      }
+    // unshift() prepends, so the oldest data goes last
+    if (leftover.length > 0) {
+      this.socket.unshift(leftover)
+    }
+    if (buffered.length > 0) {
+      this.socket.unshift(buffered)
+    }
 
-      return this.read(available, (buf) => buf)
-    })
+    // Consumers commonly destroy the stream once they're done with it, e.g.
+    // by iterating over it, which mustn't take the socket along before the
+    // exit code has been sent.
+    const stdin = new PassThrough()
+    this.socket.pipe(stdin)
+    return stdin
   }
 
-  private writeStream(cmd: WriteStreamCommand, data: Buffer) {
-    return this.send(cmd, [uint32(data.length), data])
+  /**
+   * Switches the socket to carrying the proxy's stdout as raw, unframed bytes,
+   * removing all per-write round trips.
+   *
+   * Resolves with the socket, whose writable side is the proxy's stdout from
+   * then on. Once it's ended the proxy flushes stdout and exits with
+   * `exitCode`, there's no way to pick another code afterwards. Await exit()
+   * to learn whether everything could be written. No other commands can be
+   * sent and the connection's own streams are destroyed. Requires protocol
+   * version 5.
+   */
+  public async upgradeStdout(exitCode = 0): Promise<Writable> {
+    const leftover = await this.upgrade(UPGRADE_RAW_STDOUT, exitCode, 'stdout')
+    destroyIfNecessary(this.stdin, this.stdout, this.stderr)
+    this.rawExitCode = exitCode
+
+    // Once the stream ends the proxy sends a trailer in the regular response
+    // format, reporting whether all of it reached stdout.
+    const chunks = leftover.length > 0 ? [leftover] : []
+    this.socket.on('data', (chunk: Buffer) => chunks.push(chunk))
+    this.rawTrailer = new Promise<void>((resolve, reject) => {
+      this.socket.once('close', () => {
+        const trailer = Buffer.concat(chunks)
+        if (trailer.length < 4) {
+          reject(new Error('Connection closed before the proxy finished'))
+        } else if (trailer.readInt32LE(0) !== 0) {
+          const message = trailer.subarray(8).toString('utf8')
+          reject(new Error(message || 'Failed to write stdout'))
+        } else {
+          resolve()
+        }
+      })
+    })
+    // Only reported through exit()
+    this.rawTrailer.catch(() => {})
+    this.socket.resume()
+
+    return this.socket
   }
 
-  private send(cmd: Command, payload: Buffer[], opts?: CommandOptions) {
-    return this.invoke(cmd, payload, () => Promise.resolve(), opts)
+  private async upgrade(
+    cmd: typeof UPGRADE_RAW_STDIN | typeof UPGRADE_RAW_STDOUT,
+    arg: number | undefined,
+    raw: 'stdin' | 'stdout',
+  ): Promise<Buffer> {
+    if (this.protocolVersion < 5) {
+      throw new Error(`Raw ${raw} requires protocol version 5`)
+    }
+    if (this.closed || this.raw) {
+      throw new Error('Connection closed')
+    }
+    if (this.channels.size > 0) {
+      throw new Error(`Raw ${raw} cannot be combined with data channels`)
+    }
+
+    this.stdin.suspend()
+    try {
+      await this.quiesce()
+      const leftover = await this.dispatcher.invoke<
+        typeof RESPONSE_NONE,
+        Buffer
+      >(cmd, arg, undefined, RESPONSE_NONE, { detachOnSuccess: true })
+
+      this.raw = raw
+      // The proxy stops reading once it has sent its final bytes, keep our
+      // writable side open after its readable side has ended.
+      this.socket.allowHalfOpen = true
+      return leftover
+    } catch (e) {
+      this.stdin.unsuspend()
+      throw e
+    }
   }
 
-  private invoke<T>(
-    cmd: Command,
-    payload: Buffer[],
-    readCb: () => Promise<T>,
-    opts?: CommandOptions<T>,
-  ): Promise<T> {
-    const handleInvoke = async () => {
-      await opts?.onBeforeSend?.()
+  /**
+   * Moves streams off the command socket onto dedicated data channels, extra
+   * connections the proxy opens back to the server, each carrying a single
+   * stream's bytes unframed. Streams then no longer wait behind each other or
+   * behind commands, and each gets its own kernel buffering and flow control.
+   *
+   * Stdin stops being polled and ends when the proxy's stdin does, stdout and
+   * stderr writes go straight to their channel. Commands keep using the
+   * original socket. Streams that are closed or already have a channel are
+   * skipped. Connections with data channels can't be detached or upgraded to
+   * raw passthrough. Requires protocol version 6 and a connection accepted by
+   * createProxyProcessServer, isn't supported by Windows executables.
+   */
+  public async openDataChannels(
+    streams: DataChannelStream[] = ['stdin', 'stdout', 'stderr'],
+  ): Promise<void> {
+    if (this.protocolVersion < 6) {
+      throw new Error('Data channels require protocol version 6')
+    }
+    const registry = this.dataChannels
+    if (!registry) {
+      throw new Error('Data channels require a data channel registry')
+    }
+    if (this.closed || this.raw) {
+      throw new Error('Connection closed')
+    }
 
-      if (this.closed || this.hasSentExit) {
-        if (opts?.onConnectionClosed) {
-          return opts.onConnectionClosed()
-        }
+    const pending = streams.filter(
+      (name) =>
+        !this.channels.has(name) &&
+        !this[name].destroyed &&
+        !(name === 'stdin' && this.stdin.eof),
+    )
+    if (pending.length === 0) {
+      return
+    }
+
+    // Nothing may be in flight or buffered for a stream while it switches
+    // over, or its bytes could be reordered.
+    this.stdin.suspend()
+    try {
+      await this.quiesce()
+      this.stdout.cork()
+      this.stderr.cork()
+      while (!this.dispatcher.idle) {
+        await this.dispatcher.whenIdle()
       }
 
-      await this.write(uint8(cmd))
-      for (const p of payload) {
-        await this.write(p)
+      for (const name of pending) {
+        const key = randomBytes(16)
+        const channel = registry.expect(this.token, key)
+        // May time out before the proxy has even answered, the rejection is
+        // picked up below
+        channel.catch(() => {})
+        try {
+          await this.dispatcher.invoke(
+            OPEN_DATA_CHANNEL,
+            streamFds[name],
+            key,
+            RESPONSE_NONE,
+          )
+        } catch (e) {
+          registry.cancel(key)
+          throw e
+        }
+        this.attachChannel(name, await channel)
       }
+    } finally {
+      this.stdout.uncork()
+      this.stderr.uncork()
+      this.stdin.unsuspend()
+    }
+  }
 
-      const statusCode = await this.readInt32LE()
+  private attachChannel(name: DataChannelStream, channel: Socket) {
+    channel.setNoDelay(true)
+    this.channels.set(name, channel)
+
+    if (name === 'stdin') {
+      this.stdin.attachChannel(channel)
+    } else {
+      // Failed writes reject through writeStream, and the proxy reports a
+      // broken stream with the usual notification.
+      channel.on('error', () => {})
+      channel.resume()
+    }
+  }
 
-      if (statusCode !== 0) {
-        const errorMsg = await this.readLengthPrefixedString()
-        throw new Error(errorMsg || `Unknown error ${statusCode} from proxy`)
-      }
+  private closeStream(cmd: CloseStreamCommand) {
+    // Streams closed before a migration are already closed in the proxy
+    if (this.closedStreams.delete(cmd) || this.detached || this.raw) {
+      return Promise.resolve()
+    }
+
+    const channel = this.channels.get(streamNames[cmd])
+    if (channel && cmd !== CLOSE_STDIN) {
+      // Ending the channel closes the stream in the proxy once everything
+      // sent before it has been written.
+      return new Promise<void>((resolve) => channel.end(() => resolve()))
+    }
+    channel?.destroy()
+
+    return this.send(cmd, undefined, {
+      onConnectionClosed: () => Promise.resolve(),
+    })
+  }
+
+  private handleClose(): void {
+    destroyIfNecessary(this.stdin, this.stdout, this.stderr)
+    this.channels.forEach((channel) => channel.destroy())
+    this.emit('close')
+  }
+
+  private handleError(error: Error): void {
+    this.emit('error', error)
+  }
+
+  private handleNotification(notification: number): void {
+    const event = notificationEvents[notification]
+    if (event) {
+      this.emit(event)
+    }
+  }
+
+  private readStdin(maxBytes: number): Promise<Buffer | null> {
+    if (!(this.timestamps & STAMP_STDIN)) {
+      return this.dispatcher.invoke(
+        READ_STDIN,
+        maxBytes,
+        undefined,
+        RESPONSE_BYTES,
+      )
+    }
+
+    let sent = 0n
+    let read: bigint | undefined
+    return this.dispatcher
+      .invoke(READ_STDIN, maxBytes, undefined, RESPONSE_BYTES, {
+        onBeforeSend: () => (sent = process.hrtime.bigint()),
+        // The time the proxy read the chunk precedes it. Stripped by the
+        // dispatcher so the chunk itself can still go back to a pool.
+        prefixLength: 8,
+        onPrefix: (stamp) => (read = stamp.readBigUInt64LE(0)),
+      })
+      .then((data) => {
+        if (read !== undefined) {
+          this.latencyTracker.addStdinRead(sent, read, process.hrtime.bigint())
+        }
+        return data
+      })
+  }
 
-      this.hasSentExit ||= cmd === EXIT
+  private writeStream(cmd: WriteStreamCommand, data: Buffer) {
+    const name = cmd === WRITE_STDOUT ? 'stdout' : 'stderr'
+    const channel = this.channels.get(name)
+    if (channel) {
+      return new Promise<void>((resolve, reject) =>
+        channel.write(data, (err) => (err ? reject(err) : resolve())),
+      )
+    }
 
-      return readCb()
+    if (cmd === WRITE_STDOUT && this.timestamps & STAMP_STDOUT) {
+      return this.writeStampedStdout(data)
     }
 
-    return (this.queue = this.queue.then(handleInvoke, handleInvoke))
+    return this.dispatcher.invoke(cmd, data.length, data, RESPONSE_NONE)
+  }
+
+  private async writeStampedStdout(data: Buffer) {
+    const written = process.hrtime.bigint()
+    let sent = 0n
+    const onBeforeSend = () => (sent = process.hrtime.bigint())
+    const stamp = await this.dispatcher.invoke(
+      WRITE_STDOUT,
+      data.length,
+      data,
+      RESPONSE_BYTES,
+      { onBeforeSend },
+    )
+    const done = stamp!.readBigUInt64LE(0)
+    this.latencyTracker.addStdoutWrite(
+      written,
+      sent,
+      done,
+      process.hrtime.bigint(),
+    )
+  }
+
+  private send(
+    cmd: Command,
+    arg?: number,
+    opts?: CommandOptions,
+  ): Promise<void> {
+    return this.dispatcher.invoke(cmd, arg, undefined, RESPONSE_NONE, opts)
   }
 
   public async getArgs(): Promise<string[]> {
-    return this.invoke(GET_ARGS, [], async () => {
-      const count = await this.readUInt32LE()
-      const args: string[] = []
-      for (let i = 0; i < count; i++) {
-        args.push(await this.readLengthPrefixedString())
-      }
-      return args
-    })
+    return this.getBlock('args', GET_ARGS, (args) => args)
   }
 
   public async getEnv(): Promise<Record<string, string>> {
-    return this.invoke(GET_ENV, [], async () => {
-      const count = await this.readUInt32LE()
-      const env: Record<string, string> = {}
-      for (let i = 0; i < count; i++) {
-        const envVar = await this.readLengthPrefixedString()
-        const eqIndex = envVar.indexOf('=')
-        if (eqIndex !== -1) {
-          const key = envVar.substring(0, eqIndex)
-          const value = envVar.substring(eqIndex + 1)
-          env[key] = value
-        }
-      }
-      return env
-    })
+    return this.getBlock('env', GET_ENV, (vars) =>
+      this.framing.parseEnv(vars),
+    )
+  }
+
+  /**
+   * Fetches the argument or environment block, or with an intern cache takes
+   * it from there when the proxy's digest for it is already known. With an
+   * intern cache the block is always frozen, whether or not it could be
+   * shared, so callers can't come to depend on mutating it.
+   */
+  private async getBlock<T extends object>(
+    kind: 'args' | 'env',
+    cmd: typeof GET_ARGS | typeof GET_ENV,
+    parse: (list: string[]) => T,
+  ): Promise<T> {
+    const digest = await this.getBlockDigest(kind)
+    const cached = digest && this.intern?.lookup<T>(kind, digest)
+    if (cached) {
+      return cached
+    }
+
+    const list = await this.dispatcher.invoke(
+      cmd,
+      undefined,
+      undefined,
+      RESPONSE_STRING_LIST,
+    )
+    const value = parse(list)
+
+    // Only share what actually matches the digest, e.g. environment variables
+    // that aren't valid UTF-8 don't survive decoding.
+    if (digest && this.intern && digestStringList(list).equals(digest)) {
+      return this.intern.intern(kind, digest, value)
+    }
+    return this.intern ? Object.freeze(value) : value
+  }
+
+  private async getBlockDigest(kind: 'args' | 'env') {
+    if (!this.intern || this.protocolVersion < 7) {
+      return undefined
+    }
+
+    // Both digests come in one response, computed once by the proxy
+    this.blockDigests ??= this.dispatcher
+      .invoke(GET_BLOCK_DIGESTS, undefined, undefined, RESPONSE_BYTES)
+      .catch(() => null)
+
+    const digests = await this.blockDigests
+    if (!digests || digests.length !== 64) {
+      return undefined
+    }
+    return kind === 'args' ? digests.subarray(0, 32) : digests.subarray(32)
   }
 
   public async getCwd(): Promise<string> {
-    return this.invoke(GET_CWD, [], () => this.readLengthPrefixedString())
+    return this.dispatcher.invoke(
+      GET_CWD,
+      undefined,
+      undefined,
+      RESPONSE_STRING,
+    )
   }
 
   public async exit(code: number) {
-    return this.send(EXIT, [int32(code)], {
+    if (this.raw === 'stdin') {
+      return this.exitRawStdin(code)
+    } else if (this.raw === 'stdout') {
+      return this.exitRawStdout(code)
+    }
+
+    return this.send(EXIT, code, {
       onBeforeSend: () => {
         // Destroy the streams just before sending the exit command
         // to ensure that any pending writes queued before calling exit()
         // has been sent to the proxy process.
         destroyIfNecessary(this.stdin, this.stdout, this.stderr)
-        return Promise.resolve()
       },
       onConnectionClosed: () => {
         return Promise.reject(new Error('Connection already closed'))
@@ -221,7 +830,109 @@ export class ProcessProxyConnection extends EventEmitter {
     })
   }
 
+  private exitRawStdin(code: number): Promise<void> {
+    if (this.socket.closed) {
+      return Promise.reject(new Error('Connection already closed'))
+    }
+
+    // The trailer ending a raw stdin session is just the exit code. Stdin
+    // that's still arriving is discarded unless somebody consumes it, the
+    // socket can't close before it has been read.
+    const trailer = Buffer.allocUnsafe(4)
+    trailer.writeInt32LE(code, 0)
+    this.socket.end(trailer)
+    this.socket.resume()
+
+    return new Promise((resolve) => this.socket.once('close', () => resolve()))
+  }
+
+  private exitRawStdout(code: number): Promise<void> {
+    if (code !== this.rawExitCode) {
+      return Promise.reject(
+        new Error(`Raw stdout sessions exit with ${this.rawExitCode}`),
+      )
+    }
+
+    this.socket.end()
+    return this.rawTrailer!
+  }
+
   public async isStdinConnected(): Promise<boolean> {
-    return this.invoke(IS_STDIN_CONNECTED, [], this.readInt32LE).then(Boolean)
+    return this.dispatcher
+      .invoke(IS_STDIN_CONNECTED, undefined, undefined, RESPONSE_INT32)
+      .then(Boolean)
+  }
+
+  /**
+   * Measures the round trip to the proxy and estimates the offset between
+   * its monotonic clock and ours, which latency breakdowns are based on.
+   * Requires protocol version 8.
+   */
+  public async ping(): Promise<ProcessProxyPing> {
+    if (this.protocolVersion < 8) {
+      throw new Error('Ping requires protocol version 8')
+    }
+
+    let sent = 0n
+    const onBeforeSend = () => (sent = process.hrtime.bigint())
+    const response = await this.dispatcher.invoke(
+      PING,
+      undefined,
+      undefined,
+      RESPONSE_BYTES,
+      { onBeforeSend },
+    )
+    const answered = process.hrtime.bigint()
+
+    if (!response || response.length !== 16) {
+      throw new Error('Invalid ping response')
+    }
+
+    return this.latencyTracker.addPing(
+      sent,
+      response.readBigUInt64LE(0),
+      response.readBigUInt64LE(8),
+      answered,
+    )
+  }
+
+  /**
+   * Has the proxy stamp stdin chunks with the time it read them and stdout
+   * writes with the time they completed, and samples them into `latency`.
+   * Pings the proxy `pings` times first to estimate the clock offset. Only
+   * affects streams carried over the command socket, not data channels or
+   * raw passthrough. Requires protocol version 8.
+   */
+  public async enableLatencyProbes(
+    streams: ('stdin' | 'stdout')[] = ['stdin', 'stdout'],
+    pings = 8,
+  ): Promise<void> {
+    if (this.protocolVersion < 8) {
+      throw new Error('Latency probes require protocol version 8')
+    }
+
+    for (let i = 0; i < pings; i++) {
+      await this.ping()
+    }
+
+    const flags =
+      (streams.includes('stdin') ? STAMP_STDIN : 0) |
+      (streams.includes('stdout') ? STAMP_STDOUT : 0)
+    return this.setTimestamps(flags)
+  }
+
+  /** Stops the proxy from stamping stdin and stdout, see enableLatencyProbes */
+  public async disableLatencyProbes(): Promise<void> {
+    if (this.protocolVersion < 8) {
+      throw new Error('Latency probes require protocol version 8')
+    }
+    return this.setTimestamps(0)
+  }
+
+  private setTimestamps(flags: number) {
+    // Commands queued from here on are handled by the proxy after this one,
+    // so their responses are stamped (or not) accordingly.
+    this.timestamps = flags
+    return this.send(SET_TIMESTAMPS, flags)
   }
 }
@@ -0,0 +1,76 @@
+import type { Socket } from 'net'
+
+/** Length of the key identifying a data channel in its handshake */
+export const DATA_CHANNEL_KEY_LENGTH = 16
+
+export type DataChannelStream = 'stdin' | 'stdout' | 'stderr'
+
+const DEFAULT_TIMEOUT = 1000
+
+interface PendingChannel {
+  token: string
+  resolve: (socket: Socket) => void
+  timer: NodeJS.Timeout
+}
+
+/**
+ * Pairs data channels, the extra sockets proxies open for individual streams,
+ * with the connections that asked for them.
+ *
+ * A connection generates a random key, registers it here and sends it to the
+ * proxy, which connects back and repeats the key along with its token. Only a
+ * socket presenting both is handed to the connection.
+ */
+export class DataChannelRegistry {
+  private readonly pending = new Map<string, PendingChannel>()
+
+  /**
+   * @param timeout Milliseconds to wait for the proxy to connect back before
+   * giving up on a channel. Defaults to 1000.
+   */
+  constructor(public readonly timeout = DEFAULT_TIMEOUT) {}
+
+  /** Resolves with the socket presenting the token and key */
+  public expect(token: string, key: Buffer): Promise<Socket> {
+    const id = key.toString('hex')
+
+    return new Promise((resolve, reject) => {
+      const timer = setTimeout(() => {
+        this.pending.delete(id)
+        reject(new Error('Timed out waiting for data channel'))
+      }, this.timeout)
+
+      this.pending.set(id, { token, resolve, timer })
+    })
+  }
+
+  /** Stops waiting for a channel, the promise from expect() never settles */
+  public cancel(key: Buffer) {
+    const id = key.toString('hex')
+    clearTimeout(this.pending.get(id)?.timer)
+    this.pending.delete(id)
+  }
+
+  /** True while a connection is waiting for a channel with the key */
+  public expects(key: Buffer): boolean {
+    return this.pending.has(key.toString('hex'))
+  }
+
+  /**
+   * Hands a socket to the connection waiting for it. Returns false if nobody
+   * expects the key or the token doesn't match.
+   */
+  public accept(token: string, key: Buffer, socket: Socket): boolean {
+    const id = key.toString('hex')
+    const entry = this.pending.get(id)
+
+    if (!entry || entry.token !== token) {
+      return false
+    }
+
+    clearTimeout(entry.timer)
+    this.pending.delete(id)
+    entry.resolve(socket)
+    return true
+  }
+}
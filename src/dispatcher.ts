@@ -0,0 +1,636 @@
+import { Socket } from 'net'
+import type { BufferPool } from './buffer-pool.js'
+import { jsFraming, type Framing } from './framing.js'
+
+/** The response carries no data beyond the status code */
+export const RESPONSE_NONE = 0
+/** A single 4-byte signed integer */
+export const RESPONSE_INT32 = 1
+/**
+ * A 4-byte signed length followed by that many bytes. Zero yields an empty
+ * buffer and negative lengths yield null.
+ */
+export const RESPONSE_BYTES = 2
+/** A 4-byte length followed by a UTF-8 string */
+export const RESPONSE_STRING = 3
+/** A 4-byte count followed by that many length-prefixed UTF-8 strings */
+export const RESPONSE_STRING_LIST = 4
+
+export type ResponseKind =
+  | typeof RESPONSE_NONE
+  | typeof RESPONSE_INT32
+  | typeof RESPONSE_BYTES
+  | typeof RESPONSE_STRING
+  | typeof RESPONSE_STRING_LIST
+
+interface ResponseValues {
+  [RESPONSE_NONE]: void
+  [RESPONSE_INT32]: number
+  [RESPONSE_BYTES]: Buffer | null
+  [RESPONSE_STRING]: string
+  [RESPONSE_STRING_LIST]: string[]
+}
+
+export type ResponseValue<K extends ResponseKind> = ResponseValues[K]
+
+export type CommandOptions<T = void> = {
+  onBeforeSend?: () => void
+  onConnectionClosed?: () => Promise<T>
+  /**
+   * Detach from the socket as soon as the command succeeds, for commands
+   * after which the socket stops carrying responses. The command then
+   * resolves with the bytes received after its response.
+   */
+  detachOnSuccess?: boolean
+  /**
+   * Number of bytes at the start of a non-empty bytes response that are
+   * handed to onPrefix instead of being part of the value, e.g. a timestamp.
+   * The value is then a buffer of its own that can go back to the pool. The
+   * prefix is only valid for the duration of the call.
+   */
+  prefixLength?: number
+  onPrefix?: (prefix: Buffer) => void
+}
+
+// Parser stages. The parser reads one response at a time, advancing through
+// these stages as bytes arrive and never buffering more than one field.
+const STAGE_STATUS = 0
+const STAGE_ERROR_LENGTH = 1
+const STAGE_ERROR_MESSAGE = 2
+const STAGE_VALUE = 3
+const STAGE_ITEM_LENGTH = 4
+const STAGE_ITEM = 5
+const STAGE_NOTIFICATION = 6
+
+/**
+ * Status preceding an unsolicited notification rather than a response. Only
+ * sent by protocol 0003 proxies, and only in between responses.
+ */
+const STATUS_NOTIFICATION = 1
+
+const INITIAL_SLOTS = 16
+
+interface CommandSlot {
+  cmd: number
+  arg: number | undefined
+  data: Buffer | undefined
+  response: ResponseKind
+  opts: CommandOptions<any> | undefined
+  resolve: (value: any) => void
+  reject: (error: Error) => void
+}
+
+const noop = () => {}
+
+const emptySlot = (): CommandSlot => ({
+  cmd: 0,
+  arg: undefined,
+  data: undefined,
+  response: RESPONSE_NONE,
+  opts: undefined,
+  resolve: noop,
+  reject: noop,
+})
+
+/**
+ * Sends commands to the native proxy and parses its responses.
+ *
+ * Commands are queued in a ring of reusable slots and executed strictly one at
+ * a time. Responses are decoded by a single incremental state machine fed
+ * directly from socket 'data' events, so a command costs one promise and (for
+ * fixed size responses) no intermediate buffers.
+ */
+export class CommandDispatcher {
+  private slots: CommandSlot[] = Array.from(
+    { length: INITIAL_SLOTS },
+    emptySlot,
+  )
+  private head = 0
+  private count = 0
+  private inFlight: CommandSlot | undefined
+
+  private chunks: Buffer[] = []
+  private chunkOffset = 0
+  private available = 0
+  private readonly scratch = Buffer.alloc(4)
+
+  private stage = STAGE_STATUS
+  private remaining = 0
+  private length = 0
+  private items: string[] | undefined
+
+  private hasSentExit = false
+  private detachedReason: string | undefined
+  private idleWaiters: (() => void)[] = []
+
+  private readonly onData = (chunk: Buffer) => this.handleData(chunk)
+  private readonly onClose = () => this.handleClose()
+
+  /** Number of commands written to the proxy */
+  public commandsSent = 0
+
+  constructor(
+    private readonly socket: Socket,
+    private readonly exitCommand: number,
+    private readonly onNotification: (notification: number) => void = noop,
+    private readonly pool?: BufferPool,
+    private readonly framing: Framing = jsFraming,
+  ) {
+    socket.on('data', this.onData)
+    socket.on('close', this.onClose)
+    // The handshake is read in paused mode, adding a 'data' listener alone
+    // won't switch the socket back to flowing.
+    socket.resume()
+  }
+
+  /** True while no command is in flight or queued */
+  public get idle() {
+    return !this.inFlight && this.count === 0
+  }
+
+  /** True once the exit command has been acknowledged by the proxy */
+  public get exited() {
+    return this.hasSentExit
+  }
+
+  /** Resolves the next time no command is in flight or queued */
+  public whenIdle(): Promise<void> {
+    if (this.idle) {
+      return Promise.resolve()
+    }
+    return new Promise((resolve) => this.idleWaiters.push(resolve))
+  }
+
+  /**
+   * Stops listening to the socket and returns any bytes received but not yet
+   * parsed, so that another dispatcher can pick up where this one left off.
+   * Must only be called while idle. Commands invoked afterwards fail with the
+   * given reason.
+   */
+  public detach(reason: string): Buffer {
+    this.detachedReason = reason
+    this.socket.off('data', this.onData)
+    this.socket.off('close', this.onClose)
+    // Without a 'data' listener a flowing socket would drop what it reads
+    this.socket.pause()
+
+    const pending = this.chunks.map((chunk, i) =>
+      i === 0 ? chunk.subarray(this.chunkOffset) : chunk,
+    )
+
+    if (this.stage === STAGE_NOTIFICATION) {
+      // The status has already been consumed, hand it over again
+      const status = Buffer.allocUnsafe(4)
+      status.writeInt32LE(STATUS_NOTIFICATION, 0)
+      pending.unshift(status)
+    }
+
+    this.chunks = []
+    this.chunkOffset = 0
+    this.available = 0
+    this.stage = STAGE_STATUS
+
+    return Buffer.concat(pending)
+  }
+
+  /**
+   * Parses bytes that were received by a detached dispatcher before anything
+   * arriving on the socket.
+   */
+  public restore(pending: Buffer) {
+    if (pending.length > 0) {
+      this.handleData(pending)
+    }
+  }
+
+  /**
+   * Queues a command consisting of a command byte, an optional 4-byte
+   * argument and an optional payload and resolves with its decoded response.
+   */
+  public invoke<K extends ResponseKind, T = ResponseValue<K>>(
+    cmd: number,
+    arg: number | undefined,
+    data: Buffer | undefined,
+    response: K,
+    opts?: CommandOptions<T>,
+  ): Promise<T> {
+    // The in-flight command has been shifted off the ring but its slot is still
+    // in use until its response arrives, so always keep one slot spare.
+    if (this.count + 1 === this.slots.length) {
+      this.grow()
+    }
+
+    const slot = this.slots[(this.head + this.count) % this.slots.length]
+    this.count++
+
+    slot.cmd = cmd
+    slot.arg = arg
+    slot.data = data
+    slot.response = response
+    slot.opts = opts
+
+    const promise = new Promise<T>((resolve, reject) => {
+      slot.resolve = resolve
+      slot.reject = reject
+    })
+
+    if (!this.inFlight) {
+      this.startNext()
+    }
+
+    return promise
+  }
+
+  private grow() {
+    // Only carry over queued slots, the in-flight slot (if any) is still
+    // referenced by inFlight and mustn't be handed out again.
+    const slots: CommandSlot[] = []
+    for (let i = 0; i < this.count; i++) {
+      slots.push(this.slots[(this.head + i) % this.slots.length])
+    }
+    for (let i = this.count; i < this.slots.length * 2; i++) {
+      slots.push(emptySlot())
+    }
+    this.slots = slots
+    this.head = 0
+  }
+
+  private shift(): CommandSlot {
+    const slot = this.slots[this.head]
+    this.head = (this.head + 1) % this.slots.length
+    this.count--
+    return slot
+  }
+
+  private settle(
+    slot: CommandSlot,
+    error: Error | undefined,
+    value?: unknown,
+  ) {
+    const { resolve, reject } = slot
+    slot.data = undefined
+    slot.opts = undefined
+    slot.resolve = noop
+    slot.reject = noop
+
+    if (error) {
+      reject(error)
+    } else {
+      resolve(value)
+    }
+  }
+
+  /**
+   * Starts the next queued command unless one is already awaiting a response.
+   */
+  private startNext() {
+    while (!this.inFlight && this.count > 0) {
+      const slot = this.shift()
+      const { opts } = slot
+
+      // Claim the connection before running any callbacks so that commands
+      // they queue (e.g. stream closes triggered by exit) wait their turn.
+      this.inFlight = slot
+
+      try {
+        opts?.onBeforeSend?.()
+      } catch (e) {
+        this.inFlight = undefined
+        this.settle(slot, e as Error)
+        continue
+      }
+
+      const closed = this.socket.closed || this.detachedReason !== undefined
+
+      if (closed || this.hasSentExit) {
+        if (opts?.onConnectionClosed) {
+          this.inFlight = undefined
+          // Resolving with a promise adopts its outcome
+          this.settle(slot, undefined, opts.onConnectionClosed())
+          continue
+        }
+
+        if (closed) {
+          this.inFlight = undefined
+          this.settle(
+            slot,
+            new Error(this.detachedReason ?? 'Connection closed'),
+          )
+          continue
+        }
+      }
+
+      this.stage = STAGE_STATUS
+      this.send(slot)
+    }
+
+    if (this.idle && this.idleWaiters.length > 0) {
+      const waiters = this.idleWaiters
+      this.idleWaiters = []
+      waiters.forEach((resolve) => resolve())
+    }
+  }
+
+  private send({ cmd, arg, data }: CommandSlot) {
+    this.commandsSent++
+    const length = arg === undefined ? 1 : 5
+    const pool = this.pool
+    const header = pool ? pool.alloc(length) : Buffer.allocUnsafe(length)
+    this.framing.encodeHeader(header, cmd, arg)
+
+    // The socket holds on to the header until it has been flushed
+    const onWritten = pool ? () => pool.release(header) : undefined
+
+    if (data) {
+      this.socket.cork()
+      this.socket.write(header, onWritten)
+      this.socket.write(data)
+      this.socket.uncork()
+    } else {
+      this.socket.write(header, onWritten)
+    }
+  }
+
+  private handleData(chunk: Buffer) {
+    this.chunks.push(chunk)
+    this.available += chunk.length
+    this.parse()
+  }
+
+  private handleClose() {
+    const slot = this.inFlight
+    if (slot) {
+      this.inFlight = undefined
+      this.settle(slot, new Error('Socket closed before receiving all data'))
+    }
+    this.startNext()
+  }
+
+  private readInt32(): number {
+    const first = this.chunks[0]
+    let value: number
+
+    if (first.length - this.chunkOffset >= 4) {
+      value = first.readInt32LE(this.chunkOffset)
+      this.consume(4)
+    } else {
+      this.copyTo(this.scratch, 4)
+      value = this.scratch.readInt32LE(0)
+    }
+
+    return value
+  }
+
+  private readBytes(length: number): Buffer {
+    const first = this.chunks[0]
+
+    if (first.length - this.chunkOffset >= length) {
+      const end = this.chunkOffset + length
+      const bytes = first.subarray(this.chunkOffset, end)
+      this.consume(length)
+      return bytes
+    }
+
+    // Payloads spanning chunks have to be reassembled, take the space from
+    // the pool when there is one.
+    const bytes = this.pool
+      ? this.pool.alloc(length)
+      : Buffer.allocUnsafe(length)
+    this.copyTo(bytes, length)
+    return bytes
+  }
+
+  private readPrefixedBytes(slot: CommandSlot, length: number): Buffer {
+    const prefixLength = slot.opts?.prefixLength ?? 0
+    if (prefixLength === 0 || length < prefixLength) {
+      return this.readBytes(length)
+    }
+
+    const prefix = this.readBytes(prefixLength)
+    slot.opts!.onPrefix?.(prefix)
+    this.pool?.release(prefix)
+    return length > prefixLength
+      ? this.readBytes(length - prefixLength)
+      : Buffer.alloc(0)
+  }
+
+  private copyTo(target: Buffer, length: number) {
+    let copied = 0
+    while (copied < length) {
+      const first = this.chunks[0]
+      const n = Math.min(length - copied, first.length - this.chunkOffset)
+      first.copy(target, copied, this.chunkOffset, this.chunkOffset + n)
+      copied += n
+      this.consume(n)
+    }
+  }
+
+  private consume(n: number) {
+    this.available -= n
+    this.chunkOffset += n
+    if (this.chunkOffset === this.chunks[0].length) {
+      this.chunks.shift()
+      this.chunkOffset = 0
+    }
+  }
+
+  /**
+   * Advances the response state machine as far as the buffered bytes allow.
+   * Completing a response settles its command and immediately starts the next
+   * queued one, whose response is then parsed by the same loop. Notifications
+   * may precede any response, and arrive while no command is in flight.
+   */
+  private parse() {
+    // Empty strings complete without consuming anything, so keep going while
+    // a response is part way through even if the buffer has been drained.
+    while (
+      (this.available > 0 || (this.inFlight && this.stage !== STAGE_STATUS)) &&
+      !this.socket.destroyed
+    ) {
+      const slot = this.inFlight as CommandSlot
+
+      switch (this.stage) {
+        case STAGE_STATUS: {
+          if (this.available < 4) {
+            return
+          }
+          const status = this.readInt32()
+          if (status === STATUS_NOTIFICATION) {
+            this.stage = STAGE_NOTIFICATION
+            break
+          }
+
+          if (!this.inFlight) {
+            this.socket.destroy(
+              new Error(`Unexpected status ${status} from proxy`),
+            )
+            return
+          }
+
+          if (status !== 0) {
+            this.remaining = status
+            this.stage = STAGE_ERROR_LENGTH
+            break
+          }
+
+          this.hasSentExit ||= slot.cmd === this.exitCommand
+
+          if (slot.response === RESPONSE_NONE) {
+            this.complete(undefined, undefined)
+          } else {
+            this.stage = STAGE_VALUE
+          }
+          break
+        }
+        case STAGE_ERROR_LENGTH: {
+          if (this.available < 4) {
+            return
+          }
+          this.length = this.readInt32() >>> 0
+          this.stage = STAGE_ERROR_MESSAGE
+          break
+        }
+        case STAGE_ERROR_MESSAGE: {
+          if (this.available < this.length) {
+            return
+          }
+          const message = this.readString(this.length)
+          const status = this.remaining
+          this.complete(
+            new Error(message || `Unknown error ${status} from proxy`),
+            undefined,
+          )
+          break
+        }
+        case STAGE_NOTIFICATION: {
+          if (this.available < 1) {
+            return
+          }
+          const notification = this.chunks[0][this.chunkOffset]
+          this.consume(1)
+          this.stage = STAGE_STATUS
+          this.onNotification(notification)
+          break
+        }
+        case STAGE_VALUE: {
+          if (this.available < 4) {
+            return
+          }
+          const value = this.readInt32()
+
+          if (slot.response === RESPONSE_INT32) {
+            this.complete(undefined, value)
+          } else if (slot.response === RESPONSE_BYTES) {
+            if (value <= 0) {
+              this.complete(undefined, value === 0 ? Buffer.alloc(0) : null)
+            } else {
+              this.length = value
+              this.stage = STAGE_ITEM
+            }
+          } else if (slot.response === RESPONSE_STRING) {
+            this.length = value >>> 0
+            this.stage = STAGE_ITEM
+          } else {
+            this.remaining = value >>> 0
+            this.items = []
+            if (this.remaining === 0) {
+              this.completeList()
+            } else {
+              this.stage = STAGE_ITEM_LENGTH
+            }
+          }
+          break
+        }
+        case STAGE_ITEM_LENGTH: {
+          // Decode every item that lies entirely within the first chunk in
+          // one go, only items spanning chunks go through the stages below.
+          const items = this.items!
+          const decoded = items.length
+          const first = this.chunks[0]
+          const end = first
+            ? this.framing.decodeStringList(
+                first,
+                this.chunkOffset,
+                this.remaining,
+                items,
+              )
+            : this.chunkOffset
+          if (items.length > decoded) {
+            this.consume(end - this.chunkOffset)
+            this.remaining -= items.length - decoded
+            if (this.remaining === 0) {
+              this.completeList()
+            }
+            break
+          }
+
+          if (this.available < 4) {
+            return
+          }
+          this.length = this.readInt32() >>> 0
+          this.stage = STAGE_ITEM
+          break
+        }
+        case STAGE_ITEM: {
+          if (this.available < this.length) {
+            return
+          }
+
+          if (slot.response === RESPONSE_BYTES) {
+            this.complete(undefined, this.readPrefixedBytes(slot, this.length))
+          } else if (slot.response === RESPONSE_STRING) {
+            this.complete(undefined, this.readString(this.length))
+          } else {
+            this.items!.push(this.readString(this.length))
+            if (--this.remaining === 0) {
+              this.completeList()
+            } else {
+              this.stage = STAGE_ITEM_LENGTH
+            }
+          }
+          break
+        }
+      }
+    }
+  }
+
+  private readString(length: number): string {
+    if (length === 0) {
+      return ''
+    }
+
+    const first = this.chunks[0]
+    if (first.length - this.chunkOffset >= length) {
+      const value = first.toString(
+        'utf8',
+        this.chunkOffset,
+        this.chunkOffset + length,
+      )
+      this.consume(length)
+      return value
+    }
+
+    const bytes = this.readBytes(length)
+    const value = bytes.toString('utf8')
+    this.pool?.release(bytes)
+    return value
+  }
+
+  private completeList() {
+    const items = this.items
+    this.items = undefined
+    this.complete(undefined, items)
+  }
+
+  private complete(error: Error | undefined, value: unknown) {
+    const slot = this.inFlight!
+    if (!error && slot.opts?.detachOnSuccess) {
+      // Whatever follows the response is no longer ours to parse
+      value = this.detach('Connection upgraded')
+    }
+    this.inFlight = undefined
+    this.stage = STAGE_STATUS
+    this.settle(slot, error, value)
+    this.startNext()
+  }
+}
@@ -0,0 +1,100 @@
+import { createRequire } from 'module'
+import { dirname, join } from 'path'
+import { fileURLToPath } from 'url'
+
+/**
+ * The framing work done on the server for every command and response, which
+ * can be handled either in JavaScript or by the optional native addon.
+ */
+export interface Framing {
+  /** True when implemented by the native addon */
+  readonly native: boolean
+  /**
+   * Writes a command byte followed by an optional little endian 32-bit
+   * argument to the start of target, which must have room for 1 or 5 bytes.
+   */
+  encodeHeader(target: Buffer, cmd: number, arg: number | undefined): void
+  /**
+   * Appends up to `count` length-prefixed UTF-8 strings starting at `offset`
+   * to `items`, stopping at the first one that isn't entirely within the
+   * buffer. Returns the offset just past the last string decoded.
+   */
+  decodeStringList(
+    buffer: Buffer,
+    offset: number,
+    count: number,
+    items: string[],
+  ): number
+  /** Splits NAME=value strings into an object, skipping those without '=' */
+  parseEnv(list: readonly string[]): Record<string, string>
+}
+
+export const jsFraming: Framing = {
+  native: false,
+
+  encodeHeader(target, cmd, arg) {
+    target[0] = cmd
+    if (arg !== undefined) {
+      target.writeUInt32LE(arg >>> 0, 1)
+    }
+  },
+
+  decodeStringList(buffer, offset, count, items) {
+    for (let i = 0; i < count && buffer.length - offset >= 4; i++) {
+      const length = buffer.readUInt32LE(offset)
+      if (buffer.length - offset - 4 < length) {
+        break
+      }
+      items.push(buffer.toString('utf8', offset + 4, offset + 4 + length))
+      offset += 4 + length
+    }
+    return offset
+  },
+
+  parseEnv(list) {
+    const env: Record<string, string> = {}
+    for (const envVar of list) {
+      const eqIndex = envVar.indexOf('=')
+      if (eqIndex !== -1) {
+        const key = envVar.substring(0, eqIndex)
+        const value = envVar.substring(eqIndex + 1)
+        env[key] = value
+      }
+    }
+    return env
+  },
+}
+
+/**
+ * Returns the absolute path of the framing addon for the given platform and
+ * architecture. The addon is built alongside the proxy executable but isn't
+ * required, see nativeFraming.
+ */
+export function getFramingAddonPath(
+  platform = process.platform,
+  arch = process.arch,
+): string {
+  const moduleDir = dirname(fileURLToPath(import.meta.url))
+  const addonName = `process-proxy-framing-${platform}-${arch}.node`
+  return join(moduleDir, '..', 'bin', addonName)
+}
+
+const loadNativeFraming = (): Framing | undefined => {
+  try {
+    const addon = createRequire(import.meta.url)(getFramingAddonPath())
+    // An addon left over from an older build may lack newer functions
+    if (
+      typeof addon.encodeHeader === 'function' &&
+      typeof addon.decodeStringList === 'function' &&
+      typeof addon.parseEnv === 'function'
+    ) {
+      return { ...addon, native: true }
+    }
+  } catch {
+    // Not built for this platform, or built against an incompatible Node
+  }
+  return undefined
+}
+
+/** The native addon, or undefined when it isn't available */
+export const nativeFraming = loadNativeFraming()
@@ -1,17 +1,84 @@
 import { createServer, ServerOpts, Socket } from 'net'
 import { ProcessProxyConnection } from './connection.js'
+import { PollScheduler } from './poll-scheduler.js'
+import { AdmissionController } from './admission.js'
+import { InternCache } from './intern-cache.js'
+import { BufferPool } from './buffer-pool.js'
+import { jsFraming, nativeFraming } from './framing.js'
+import {
+  DATA_CHANNEL_KEY_LENGTH,
+  DataChannelRegistry,
+  type DataChannelStream,
+} from './data-channel.js'
 export { ProcessProxyConnection } from './connection.js'
+export { PollScheduler } from './poll-scheduler.js'
+export {
+  AdmissionController,
+  type AdmissionControllerOptions,
+} from './admission.js'
+export {
+  migrateConnection,
+  receiveConnection,
+  type MigrationTarget,
+} from './migration.js'
+export { InternCache } from './intern-cache.js'
+export { BufferPool } from './buffer-pool.js'
+export {
+  jsFraming,
+  nativeFraming,
+  getFramingAddonPath,
+  type Framing,
+} from './framing.js'
+export {
+  DataChannelRegistry,
+  type DataChannelStream,
+} from './data-channel.js'
+export {
+  pipeChildProcess,
+  type ChildProcessTransport,
+  type PipeChildProcessOptions,
+  type PipeChildProcessResult,
+} from './child-process.js'
+export {
+  LatencyTracker,
+  type LatencyStats,
+  type ProcessProxyLatency,
+  type ProcessProxyPing,
+} from './latency.js'
+export {
+  ConnectionRebalancer,
+  type ConnectionRebalancerOptions,
+  type RebalancerPeer,
+} from './rebalancer.js'
 import { fileURLToPath } from 'url'
 import { dirname, join } from 'path'
 import { readSocket } from './read-socket.js'
 import { getTargetArchs } from '../script/get-target-archs.mjs'
 
-const HANDSHAKE_PROTOCOL = 'ProcessProxy 0002 '
+// Protocol versions this server understands, keyed by handshake header.
+// Older proxies are served without any of the later extensions.
+const HANDSHAKE_PROTOCOLS: Record<string, number> = {
+  'ProcessProxy 0002 ': 2,
+  'ProcessProxy 0003 ': 3,
+  'ProcessProxy 0004 ': 4,
+  'ProcessProxy 0005 ': 5,
+  'ProcessProxy 0006 ': 6,
+  'ProcessProxy 0007 ': 7,
+  'ProcessProxy 0008 ': 8,
+}
+// Sent by protocol 0006 proxies on the extra sockets they open for data
+// channels, followed by the token and the channel's key.
+const DATA_CHANNEL_HEADER = 'ProcessProxy Data '
 const HANDSHAKE_PROTOCOL_LENGTH = 18
 const HANDSHAKE_TOKEN_LENGTH = 128
 const HANDSHAKE_LENGTH = HANDSHAKE_PROTOCOL_LENGTH + HANDSHAKE_TOKEN_LENGTH // 146 bytes
 const DEFAULT_HANDSHAKE_TIMEOUT = 1000
 
+// Sent in place of the first command to turn a proxy away, followed by the
+// number of milliseconds it should wait before reconnecting. Understood by
+// protocol 0004 proxies.
+const RETRY_LATER = 0x0d
+
 export interface ProxyProcessServerOptions extends ServerOpts {
   /**
    * Optional callback to validate the connection token.
@@ -23,6 +90,45 @@ export interface ProxyProcessServerOptions extends ServerOpts {
    * Optional handshake timeout in milliseconds. Defaults to 1000ms.
    */
   handshakeTimeout?: number
+  /**
+   * Optional scheduler used to coalesce stdin polling across connections.
+   * Defaults to a new scheduler shared by all connections of this server.
+   */
+  pollScheduler?: PollScheduler
+  /**
+   * Optional admission controller that holds back or turns away new
+   * connections while the server is overloaded. By default every connection
+   * is accepted.
+   */
+  admission?: AdmissionController
+  /**
+   * Optionally moves streams onto dedicated data channels, see
+   * ProcessProxyConnection.openDataChannels. Either true for all three
+   * streams or a list of streams. Channels are opened before the listener is
+   * called, connections that can't open them carry on over a single socket.
+   */
+  dataChannels?: boolean | DataChannelStream[]
+  /**
+   * Optionally shares argument and environment blocks between connections
+   * whose proxies report identical content, see InternCache. Pass true for a
+   * cache private to this server or a cache to share across servers.
+   * getArgs() and getEnv() then return frozen objects. Off by default.
+   */
+  intern?: boolean | InternCache
+  /**
+   * Optionally reassembles payloads into buffers sliced from recycled slabs
+   * shared by all connections, see BufferPool. Pass true for a pool private
+   * to this server or a pool to share across servers. Off by default.
+   */
+  bufferPool?: boolean | BufferPool
+  /**
+   * Encode commands and decode argument and environment blocks with the
+   * optional native addon, see nativeFraming. Falls back to JavaScript when
+   * the addon isn't available. Off by default, on current Node versions
+   * calling into the addon costs more than the work it takes over, see
+   * bench/framing.bench.ts.
+   */
+  nativeFraming?: boolean
 }
 
 /**
@@ -39,16 +145,69 @@ export const createProxyProcessServer = (
   listener: (conn: ProcessProxyConnection) => void,
   options?: ProxyProcessServerOptions,
 ) => {
-  const { validateConnection, handshakeTimeout, ...serverOpts } = options || {}
+  const {
+    validateConnection,
+    handshakeTimeout,
+    pollScheduler = new PollScheduler(),
+    admission,
+    dataChannels,
+    intern,
+    bufferPool,
+    nativeFraming: useNativeFraming,
+    ...serverOpts
+  } = options || {}
 
-  return createServer(serverOpts, (socket) => {
-    ensureValidHandshake(
+  const timeout = handshakeTimeout ?? DEFAULT_HANDSHAKE_TIMEOUT
+  const registry = new DataChannelRegistry(timeout)
+  const channelStreams = dataChannels === true ? undefined : dataChannels || []
+  const internCache = intern === true ? new InternCache() : intern || undefined
+  const pool = bufferPool === true ? new BufferPool() : bufferPool || undefined
+  const framing = (useNativeFraming && nativeFraming) || jsFraming
+
+  const accept = async (socket: Socket) => {
+    const handshake = await ensureValidHandshake(
       socket,
       validateConnection,
-      handshakeTimeout ?? DEFAULT_HANDSHAKE_TIMEOUT,
+      timeout,
+      admission,
+      registry,
     )
-      .then((token) => listener(new ProcessProxyConnection(socket, token)))
-      .catch((e) => socket.end())
+
+    const { token, protocolVersion, dataChannelKey } = handshake
+
+    if (dataChannelKey) {
+      if (registry.accept(token, dataChannelKey, socket)) {
+        admission?.addDataChannel(socket)
+      } else {
+        socket.end()
+      }
+      return
+    }
+
+    const connection = new ProcessProxyConnection(socket, token, {
+      pollScheduler,
+      protocolVersion,
+      dataChannels: registry,
+      intern: internCache,
+      bufferPool: pool,
+      framing,
+    })
+
+    if (dataChannels && protocolVersion >= 6) {
+      // Not fatal, e.g. Windows proxies don't support data channels
+      await connection.openDataChannels(channelStreams).catch(() => {})
+    }
+
+    listener(connection)
+  }
+
+  return createServer(serverOpts, (socket) => {
+    accept(socket).catch((e) => {
+      // Anything the proxy sent meanwhile, e.g. a notification, has to be
+      // consumed or the socket never sees the end of the stream and lingers
+      socket.resume()
+      socket.end()
+    })
   })
 }
 
@@ -56,7 +215,13 @@ const ensureValidHandshake = async (
   socket: Socket,
   validateConnection: ((token: string) => Promise<boolean>) | undefined,
   timeoutMs: number,
-): Promise<string> => {
+  admission: AdmissionController | undefined,
+  registry: DataChannelRegistry,
+): Promise<{
+  token: string
+  protocolVersion: number
+  dataChannelKey?: Buffer
+}> => {
   const buffer = await readSocket(
     socket,
     HANDSHAKE_LENGTH,
@@ -67,10 +232,43 @@ const ensureValidHandshake = async (
     .subarray(0, HANDSHAKE_PROTOCOL_LENGTH)
     .toString('utf-8')
 
-  if (protocolHeader !== HANDSHAKE_PROTOCOL) {
+  const isDataChannel = protocolHeader === DATA_CHANNEL_HEADER
+  const protocolVersion = isDataChannel
+    ? 6
+    : HANDSHAKE_PROTOCOLS[protocolHeader]
+
+  if (protocolVersion === undefined) {
     throw new Error('Invalid handshake protocol')
   }
 
+  const dataChannelKey = isDataChannel
+    ? await readSocket(
+        socket,
+        DATA_CHANNEL_KEY_LENGTH,
+        AbortSignal.timeout(timeoutMs),
+      )
+    : undefined
+
+  // Data channels belong to a connection that has already been admitted and
+  // is waiting for them, so they skip admission (the controller still counts
+  // their buffered bytes). Channels nobody asked for are dropped before any
+  // validation so that a burst of them costs next to nothing.
+  if (dataChannelKey && !registry.expects(dataChannelKey)) {
+    throw new Error('Unexpected data channel')
+  }
+
+  // Admit the connection before validating it, so that expensive validation
+  // is deferred along with everything else while the server is overloaded.
+  if (!isDataChannel && admission && !(await admission.admit(socket))) {
+    if (protocolVersion >= 4 && !socket.destroyed) {
+      const retry = Buffer.allocUnsafe(5)
+      retry[0] = RETRY_LATER
+      retry.writeUInt32LE(admission.retryAfter >>> 0, 1)
+      socket.write(retry)
+    }
+    throw new Error('Server overloaded')
+  }
+
   // Parse token (128 bytes) - read until first null byte
   const tokenBuffer = buffer.subarray(
     HANDSHAKE_PROTOCOL_LENGTH,
@@ -89,7 +287,7 @@ const ensureValidHandshake = async (
     }
   }
 
-  return token
+  return { token, protocolVersion, dataChannelKey }
 }
 
 /**
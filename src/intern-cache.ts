@@ -0,0 +1,88 @@
+import { createHash } from 'crypto'
+
+const DEFAULT_MAX_ENTRIES = 256
+
+/**
+ * Serializes a string list the way the proxy sends it, a count followed by
+ * length prefixed UTF-8 strings, so its digest can be checked against the
+ * one the proxy reported.
+ */
+export const digestStringList = (list: readonly string[]): Buffer => {
+  const hash = createHash('sha256')
+  const length = Buffer.allocUnsafe(4)
+
+  length.writeUInt32LE(list.length, 0)
+  hash.update(length)
+  for (const str of list) {
+    const bytes = Buffer.from(str, 'utf8')
+    length.writeUInt32LE(bytes.length, 0)
+    hash.update(length)
+    hash.update(bytes)
+  }
+
+  return hash.digest()
+}
+
+/**
+ * Shares argument and environment blocks between connections whose proxies
+ * report the same content digest, typically thousands of proxies launched by
+ * the same parent. Connections on a hit skip transferring the block and
+ * receive the same frozen object.
+ *
+ * Blocks are only interned after the received content has been checked
+ * against its digest, so a proxy can't plant a block for a digest it doesn't
+ * match. The least recently used blocks are evicted beyond `maxEntries`.
+ */
+export class InternCache {
+  private readonly entries = new Map<string, unknown>()
+
+  /** Number of lookups answered from the cache */
+  public hits = 0
+  /** Number of lookups that required transferring the block */
+  public misses = 0
+
+  constructor(public readonly maxEntries = DEFAULT_MAX_ENTRIES) {}
+
+  /** Number of blocks currently interned */
+  public get size() {
+    return this.entries.size
+  }
+
+  public lookup<T>(kind: string, digest: Buffer): T | undefined {
+    const key = `${kind}:${digest.toString('hex')}`
+    const value = this.entries.get(key)
+
+    if (value === undefined) {
+      this.misses++
+      return undefined
+    }
+
+    // Maps iterate in insertion order, re-inserting marks it most recent
+    this.entries.delete(key)
+    this.entries.set(key, value)
+    this.hits++
+    return value as T
+  }
+
+  /**
+   * Stores a frozen value under the digest, or returns the value already
+   * stored if another connection got there first.
+   */
+  public intern<T extends object>(kind: string, digest: Buffer, value: T): T {
+    const key = `${kind}:${digest.toString('hex')}`
+    const existing = this.entries.get(key)
+    if (existing !== undefined) {
+      return existing as T
+    }
+
+    this.entries.set(key, Object.freeze(value))
+    if (this.entries.size > this.maxEntries) {
+      this.entries.delete(this.entries.keys().next().value!)
+    }
+    return value
+  }
+
+  public clear() {
+    this.entries.clear()
+  }
+}
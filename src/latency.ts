@@ -0,0 +1,150 @@
+/** Statistics for one leg of the path data takes, in milliseconds */
+export interface LatencyStats {
+  count: number
+  mean: number
+  max: number
+  last: number
+}
+
+export interface ProcessProxyPing {
+  /** Round trip time, excluding the time the proxy took to respond */
+  rtt: number
+  /** Proxy clock minus local clock */
+  clockOffset: number
+}
+
+/**
+ * Latency of a connection broken down by leg, in milliseconds. Legs that
+ * span both processes rely on the clock offset estimated from the ping with
+ * the shortest round trip, so they can be off by up to half of `rtt`.
+ */
+export interface ProcessProxyLatency extends ProcessProxyPing {
+  stdin: {
+    /** READ_STDIN sent until the proxy read the chunk from stdin */
+    request: LatencyStats
+    /** Proxy read the chunk until its response had been parsed */
+    delivery: LatencyStats
+  }
+  stdout: {
+    /** Write handed to the connection until its command was sent */
+    queued: LatencyStats
+    /** Command sent until the proxy had written the bytes to stdout */
+    transit: LatencyStats
+    /** Write handed to the connection until the bytes hit stdout */
+    total: LatencyStats
+    /** Bytes written to stdout until the response had been parsed */
+    ack: LatencyStats
+  }
+}
+
+const toMs = (ns: bigint) => Number(ns) / 1e6
+
+class Leg {
+  private count = 0
+  private sum = 0
+  private max = -Infinity
+  private last = 0
+
+  public add(ns: bigint) {
+    const ms = toMs(ns)
+    this.count++
+    this.sum += ms
+    this.max = Math.max(this.max, ms)
+    this.last = ms
+  }
+
+  public get stats(): LatencyStats {
+    const { count, sum, max, last } = this
+    return count === 0
+      ? { count, mean: 0, max: 0, last }
+      : { count, mean: sum / count, max, last }
+  }
+}
+
+/**
+ * Turns timestamps taken on the proxy's monotonic clock into latencies
+ * measured against process.hrtime.bigint(). The clock offset is estimated
+ * NTP style from pings, keeping the one with the shortest round trip since
+ * it bounds the estimate's error most tightly.
+ */
+export class LatencyTracker {
+  private rtt: bigint | undefined
+  private offset = 0n
+
+  private readonly stdinRequest = new Leg()
+  private readonly stdinDelivery = new Leg()
+  private readonly stdoutQueued = new Leg()
+  private readonly stdoutTransit = new Leg()
+  private readonly stdoutTotal = new Leg()
+  private readonly stdoutAck = new Leg()
+
+  /**
+   * Records a ping sent at `sent`, received and answered by the proxy at
+   * `received` and `replied`, and whose response was parsed at `answered`.
+   */
+  public addPing(
+    sent: bigint,
+    received: bigint,
+    replied: bigint,
+    answered: bigint,
+  ): ProcessProxyPing {
+    const rtt = answered - sent - (replied - received)
+    const offset = (received - sent + (replied - answered)) / 2n
+
+    if (this.rtt === undefined || rtt <= this.rtt) {
+      this.rtt = rtt
+      this.offset = offset
+    }
+
+    return { rtt: toMs(rtt), clockOffset: toMs(offset) }
+  }
+
+  /** Records a stdin chunk read by the proxy at `read` */
+  public addStdinRead(sent: bigint, read: bigint, parsed: bigint) {
+    if (this.rtt === undefined) {
+      return
+    }
+    const local = read - this.offset
+    this.stdinRequest.add(local - sent)
+    this.stdinDelivery.add(parsed - local)
+  }
+
+  /** Records a stdout write the proxy finished at `done` */
+  public addStdoutWrite(
+    written: bigint,
+    sent: bigint,
+    done: bigint,
+    acked: bigint,
+  ) {
+    if (this.rtt === undefined) {
+      return
+    }
+    const local = done - this.offset
+    this.stdoutQueued.add(sent - written)
+    this.stdoutTransit.add(local - sent)
+    this.stdoutTotal.add(local - written)
+    this.stdoutAck.add(acked - local)
+  }
+
+  /** The breakdown so far, undefined until the proxy has been pinged */
+  public get latency(): ProcessProxyLatency | undefined {
+    if (this.rtt === undefined) {
+      return undefined
+    }
+
+    return {
+      rtt: toMs(this.rtt),
+      clockOffset: toMs(this.offset),
+      stdin: {
+        request: this.stdinRequest.stats,
+        delivery: this.stdinDelivery.stats,
+      },
+      stdout: {
+        queued: this.stdoutQueued.stats,
+        transit: this.stdoutTransit.stats,
+        total: this.stdoutTotal.stats,
+        ack: this.stdoutAck.stats,
+      },
+    }
+  }
+}
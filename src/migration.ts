@@ -0,0 +1,74 @@
+import { Socket } from 'net'
+import {
+  ProcessProxyConnection,
+  type ProcessProxyConnectionOptions,
+  type ProcessProxyConnectionState,
+} from './connection.js'
+
+const MIGRATION_MESSAGE = 'process-proxy:migrate-connection'
+
+/**
+ * Anything that can send a message along with a socket handle to another
+ * process, e.g. a ChildProcess, a cluster Worker or `process` in a child.
+ */
+export interface MigrationTarget {
+  send(
+    message: unknown,
+    sendHandle: Socket,
+    callback?: (error: Error | null) => void,
+  ): boolean
+}
+
+interface MigrationMessage {
+  type: typeof MIGRATION_MESSAGE
+  state: ProcessProxyConnectionState
+  data?: unknown
+}
+
+const isMigrationMessage = (message: unknown): message is MigrationMessage =>
+  typeof message === 'object' &&
+  message !== null &&
+  (message as MigrationMessage).type === MIGRATION_MESSAGE
+
+/**
+ * Detaches a connection in between commands and sends it, together with its
+ * socket, to another process which picks it up with receiveConnection. The
+ * socket is handed to `target.send()` as soon as the connection has been
+ * detached, before anything else can be read into its buffer.
+ *
+ * @param data Optional JSON serializable data handed to the receiving end,
+ * e.g. to identify what the connection was being used for.
+ */
+export async function migrateConnection(
+  connection: ProcessProxyConnection,
+  target: MigrationTarget,
+  data?: unknown,
+): Promise<void> {
+  const { socket, state } = await connection.detach()
+  const message: MigrationMessage = { type: MIGRATION_MESSAGE, state, data }
+
+  await new Promise<void>((resolve, reject) => {
+    target.send(message, socket, (error) => (error ? reject(error) : resolve()))
+  })
+}
+
+/**
+ * Recreates a connection sent by migrateConnection. Meant to be called from a
+ * 'message' listener, returns undefined for unrelated messages.
+ */
+export function receiveConnection(
+  message: unknown,
+  handle: unknown,
+  options?: Omit<ProcessProxyConnectionOptions, 'protocolVersion'>,
+): { connection: ProcessProxyConnection; data: unknown } | undefined {
+  if (!isMigrationMessage(message) || !(handle instanceof Socket)) {
+    return undefined
+  }
+
+  const connection = ProcessProxyConnection.attach(
+    handle,
+    message.state,
+    options,
+  )
+  return { connection, data: message.data }
+}
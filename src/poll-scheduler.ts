@@ -0,0 +1,115 @@
+import { performance } from 'perf_hooks'
+
+const DEFAULT_TICK_INTERVAL = 10
+
+/**
+ * Coalesces delayed callbacks from many streams into shared ticks.
+ *
+ * Rather than every polling stream running its own timer, callbacks are
+ * bucketed by the tick they're due in, aligned to a global grid of
+ * `tickInterval` milliseconds, and a single timer is armed for the earliest
+ * non-empty tick. Streams with the same polling cadence therefore wake up
+ * together and the event loop sees at most one timer per tick no matter how
+ * many connections are polling.
+ */
+export class PollScheduler {
+  private readonly buckets = new Map<number, (() => void)[]>()
+  private timer: NodeJS.Timeout | undefined
+  private timerTick = Infinity
+
+  /** Number of times the scheduler has woken up the event loop */
+  public ticks = 0
+  /** Number of callbacks the scheduler has invoked */
+  public polls = 0
+
+  constructor(public readonly tickInterval = DEFAULT_TICK_INTERVAL) {}
+
+  /**
+   * Invokes the callback once, no earlier than `delay` milliseconds from now
+   * and no later than the end of the tick that delay falls in.
+   */
+  public schedule(callback: () => void, delay: number) {
+    const tick = Math.ceil((performance.now() + delay) / this.tickInterval)
+
+    let bucket = this.buckets.get(tick)
+    if (!bucket) {
+      bucket = []
+      this.buckets.set(tick, bucket)
+    }
+    bucket.push(callback)
+
+    if (tick < this.timerTick) {
+      this.arm(tick)
+    }
+  }
+
+  /**
+   * Cancels a callback scheduled with schedule() that hasn't been invoked
+   * yet. The timer is disarmed once nothing is left to run.
+   */
+  public unschedule(callback: () => void) {
+    for (const [tick, bucket] of this.buckets) {
+      const index = bucket.indexOf(callback)
+      if (index !== -1) {
+        bucket.splice(index, 1)
+        if (bucket.length === 0) {
+          this.buckets.delete(tick)
+        }
+        break
+      }
+    }
+
+    if (this.buckets.size === 0 && this.timer) {
+      clearTimeout(this.timer)
+      this.timer = undefined
+      this.timerTick = Infinity
+    }
+  }
+
+  private arm(tick: number) {
+    clearTimeout(this.timer)
+    this.timerTick = tick
+
+    const delay = tick * this.tickInterval - performance.now()
+    this.timer = setTimeout(this.run, Math.max(0, delay))
+  }
+
+  private run = () => {
+    this.timer = undefined
+    this.timerTick = Infinity
+    this.ticks++
+
+    // Timers may fire a fraction of a millisecond early, allow for that
+    // rather than re-arming for the remainder.
+    const now = Math.floor((performance.now() + 1) / this.tickInterval)
+    const due: (() => void)[][] = []
+
+    for (const [tick, bucket] of this.buckets) {
+      if (tick <= now) {
+        due.push(bucket)
+        this.buckets.delete(tick)
+      }
+    }
+
+    for (const bucket of due) {
+      for (const callback of bucket) {
+        this.polls++
+        callback()
+      }
+    }
+
+    let next = Infinity
+    for (const tick of this.buckets.keys()) {
+      next = Math.min(next, tick)
+    }
+
+    if (next < this.timerTick) {
+      this.arm(next)
+    }
+  }
+}
+
+/**
+ * Scheduler shared by connections that weren't given one explicitly.
+ */
+export const defaultPollScheduler = new PollScheduler()
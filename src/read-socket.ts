@@ -42,7 +42,8 @@ export async function readSocket(
 
         if (bytesReceived >= length) {
           cleanup()
-          resolve(Buffer.concat(chunks))
+          // Usually read in one go, no need to copy it then
+          resolve(chunks.length === 1 ? chunks[0] : Buffer.concat(chunks))
           return
         }
       }
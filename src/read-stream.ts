@@ -1,26 +1,184 @@
+import type { Socket } from 'net'
 import { Readable } from 'stream'
+import { defaultPollScheduler, PollScheduler } from './poll-scheduler.js'
+import type { BufferPool } from './buffer-pool.js'
+
+/** The proxy caps a single READ_STDIN at 1MB */
+export const MAX_STDIN_READ_BYTES = 1024 * 1024
 
 export class ReadStream extends Readable {
+  /** Maximum delay between polls once stdin has been idle for a while */
   public pollingInterval = 100
+  /** Delay before the first poll after stdin last produced data */
+  public minPollingInterval = 10
+  /** Smallest read size requested, defaults to the stream's highWaterMark */
+  public minReadSize = this.readableHighWaterMark
+  /** Largest read size requested, at most MAX_STDIN_READ_BYTES */
+  public maxReadSize = MAX_STDIN_READ_BYTES
+
+  /**
+   * Number of bytes requested per read. Doubles whenever a read fills the
+   * request and halves when reads come back mostly empty, so bulk transfers
+   * take few round trips while trickling input keeps reads small.
+   */
+  public get readSize() {
+    return this._readSize
+  }
+
+  public set readSize(value: number) {
+    this._readSize = Math.max(1, Math.min(value, MAX_STDIN_READ_BYTES))
+  }
+
+  /** Total number of bytes read from stdin */
+  public bytesRead = 0
+
+  /** True once the proxy has reported the end of stdin */
+  public get eof() {
+    return this._eof
+  }
+
+  private _readSize = this.minReadSize
+  private _eof = false
+  private suspended = false
+  private readSkipped = false
+  private pollDelay = this.minPollingInterval
+  private pollPending = false
+  private paused = false
+  private channel: Socket | undefined
+  private readonly poll = () => {
+    this.pollPending = false
+    this._read()
+  }
 
   constructor(
     private readonly readStdin: (maxBytes: number) => Promise<Buffer | null>,
     private readonly closeStdin: () => Promise<void>,
+    private readonly scheduler: PollScheduler = defaultPollScheduler,
+    private readonly pool?: BufferPool,
   ) {
     super()
+    // A paused stream may be consumed with read() without resuming it
+    this.on('newListener', (event) => event === 'readable' && this.unpause())
+  }
+
+  /**
+   * Hands a chunk emitted by the stream back to the connection's buffer pool
+   * once it's no longer needed, see BufferPool. Optional, and does nothing
+   * without a pool.
+   */
+  public release(chunk: Buffer) {
+    this.pool?.release(chunk)
+  }
+
+  /**
+   * Pauses the stream and takes it off the poll scheduler until it's resumed
+   * or a 'readable' listener is added, rather than polling the proxy on
+   * behalf of nobody.
+   */
+  public pause(): this {
+    super.pause()
+    this.paused = true
+    if (this.pollPending) {
+      this.scheduler.unschedule(this.poll)
+    }
+    return this
+  }
+
+  public resume(): this {
+    this.unpause()
+    return super.resume()
+  }
+
+  private unpause() {
+    if (this.paused) {
+      this.paused = false
+      if (this.pollPending) {
+        this.scheduler.schedule(this.poll, 0)
+      }
+    }
   }
 
-  _read(size: number): void {
+  private schedulePoll(delay: number) {
+    this.pollPending = true
+    if (!this.paused) {
+      this.scheduler.schedule(this.poll, delay)
+    }
+  }
+
+  /**
+   * Stops issuing reads to the proxy, a read already in progress still
+   * completes. Used when the connection is about to be migrated.
+   */
+  public suspend() {
+    this.suspended = true
+  }
+
+  /** Undoes suspend(), issuing any read requested in the meantime */
+  public unsuspend() {
+    this.suspended = false
+    if (this.readSkipped) {
+      this.readSkipped = false
+      this._read()
+    }
+  }
+
+  /**
+   * Switches from polling the proxy to receiving stdin over a dedicated data
+   * channel, which the proxy ends along with stdin. The channel is paused
+   * whenever the stream's buffer is full.
+   */
+  public attachChannel(channel: Socket) {
+    this.channel = channel
+    channel.on('data', (chunk: Buffer) => {
+      this.bytesRead += chunk.length
+      if (!this.push(chunk)) {
+        channel.pause()
+      }
+    })
+    channel.on('end', () => {
+      this._eof = true
+      this.push(null)
+    })
+    channel.on('error', (err) => this.destroy(err))
+    channel.pause()
+  }
+
+  _read(): void {
+    if (this.destroyed) {
+      return
+    }
+
+    if (this.channel && !this.suspended) {
+      this.channel.resume()
+      return
+    }
+
+    if (this.suspended) {
+      this.readSkipped = true
+      return
+    }
+
+    const size = this._readSize
+
     this.readStdin(size)
-      .then(async (data) => {
-        while (data && data.length === 0 && this.readableFlowing) {
-          await new Promise((resolve) =>
-            setTimeout(resolve, this.pollingInterval),
-          )
-          if (!this.readableFlowing) {
-            return
-          }
-          data = await this.readStdin(size)
+      .then((data) => {
+        if (data && data.length === 0) {
+          // Nothing available yet. Back off exponentially while stdin stays
+          // idle, and poll at the slowest rate while nobody is consuming.
+          const delay = this.readableFlowing
+            ? this.pollDelay
+            : this.pollingInterval
+          this.pollDelay = Math.min(this.pollDelay * 2, this.pollingInterval)
+          this.schedulePoll(delay)
+          return
+        }
+
+        if (data) {
+          this.bytesRead += data.length
+          this.pollDelay = this.minPollingInterval
+          this.adjustReadSize(size, data.length)
+        } else {
+          this._eof = true
         }
 
         this.push(data)
@@ -28,7 +186,24 @@ export class ReadStream extends Readable {
       .catch((err) => this.destroy(err))
   }
 
+  private adjustReadSize(requested: number, received: number) {
+    const max = Math.min(this.maxReadSize, MAX_STDIN_READ_BYTES)
+    const min = Math.min(this.minReadSize, max)
+
+    if (received >= requested) {
+      this._readSize = Math.min(requested * 2, max)
+    } else if (received < requested / 4) {
+      this._readSize = Math.max(Math.floor(requested / 2), min)
+    } else {
+      this._readSize = Math.min(Math.max(requested, min), max)
+    }
+  }
+
   _destroy(err: Error | null, callback: (error?: Error | null) => void): void {
+    if (this.pollPending) {
+      this.scheduler.unschedule(this.poll)
+    }
+
     // TODO: Which error should we prioritize? The one from the destroy call or
     // the one from the closeStdin call?
     this.closeStdin()
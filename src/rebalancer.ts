@@ -0,0 +1,191 @@
+import { EventEmitter } from 'events'
+import { performance } from 'perf_hooks'
+import type { ProcessProxyConnection } from './connection.js'
+import { migrateConnection, type MigrationTarget } from './migration.js'
+
+const DEFAULT_INTERVAL = 5000
+const DEFAULT_THRESHOLD = 1.25
+const DEFAULT_MAX_MIGRATIONS = 1
+
+export interface RebalancerPeer {
+  /** Load of the peer in bytes per second, as reported by its rebalancer */
+  load: number
+  /** Where connections are sent to move them to the peer */
+  target: MigrationTarget
+}
+
+export interface ConnectionRebalancerOptions {
+  /**
+   * Returns the other workers connections may be moved to along with their
+   * current load.
+   */
+  getPeers: () => RebalancerPeer[] | Promise<RebalancerPeer[]>
+  /** Milliseconds between rebalancing rounds. Defaults to 5000. */
+  interval?: number
+  /**
+   * How far above the average load this worker must be, as a factor, before
+   * it sheds connections. Defaults to 1.25.
+   */
+  threshold?: number
+  /** Maximum number of connections moved per round. Defaults to 1. */
+  maxMigrations?: number
+}
+
+interface ConnectionLoad {
+  bytes: number
+  rate: number
+}
+
+const totalBytes = ({ stats }: ProcessProxyConnection) =>
+  stats.stdinBytes + stats.stdoutBytes + stats.stderrBytes
+
+/**
+ * Moves connections from this worker to less loaded peers.
+ *
+ * Each round the throughput of every tracked connection is sampled from its
+ * stats, smoothed across rounds, and summed into the worker's load. When that
+ * load exceeds the average across the worker and its peers by more than the
+ * threshold, the busiest connections that fit within half the gap to the
+ * least loaded peer are migrated to it. Moving at most half the gap keeps two
+ * workers from trading the same connection back and forth.
+ *
+ * Connections that can't be migrated, see ProcessProxyConnection.migratable,
+ * are left alone. Emits 'migrated' with the connection and peer for each
+ * move, and 'error' for each connection that fails to move and if a round
+ * fails.
+ */
+export class ConnectionRebalancer extends EventEmitter {
+  public readonly interval: number
+  public readonly threshold: number
+  public readonly maxMigrations: number
+
+  private readonly getPeers: ConnectionRebalancerOptions['getPeers']
+  private readonly connections = new Map<
+    ProcessProxyConnection,
+    ConnectionLoad
+  >()
+  private timer: NodeJS.Timeout | undefined
+  private lastSample = performance.now()
+
+  /** Number of connections migrated away */
+  public migrations = 0
+
+  constructor(options: ConnectionRebalancerOptions) {
+    super()
+    this.getPeers = options.getPeers
+    this.interval = options.interval ?? DEFAULT_INTERVAL
+    this.threshold = options.threshold ?? DEFAULT_THRESHOLD
+    this.maxMigrations = options.maxMigrations ?? DEFAULT_MAX_MIGRATIONS
+  }
+
+  /** Combined throughput of all tracked connections in bytes per second */
+  public get load() {
+    let load = 0
+    for (const { rate } of this.connections.values()) {
+      load += rate
+    }
+    return load
+  }
+
+  /** Smoothed throughput of a tracked connection in bytes per second */
+  public throughput(connection: ProcessProxyConnection) {
+    return this.connections.get(connection)?.rate ?? 0
+  }
+
+  /** Tracks a connection until it closes or is migrated */
+  public add(connection: ProcessProxyConnection) {
+    if (connection.closed || this.connections.has(connection)) {
+      return
+    }
+
+    this.connections.set(connection, { bytes: totalBytes(connection), rate: 0 })
+    const remove = () => this.connections.delete(connection)
+    connection.once('close', remove)
+    connection.once('detaching', remove)
+  }
+
+  public start() {
+    if (!this.timer) {
+      this.timer = setInterval(() => {
+        this.rebalance().catch((error) => this.emit('error', error))
+      }, this.interval)
+      this.timer.unref()
+    }
+  }
+
+  public stop() {
+    clearInterval(this.timer)
+    this.timer = undefined
+  }
+
+  /**
+   * Samples throughput and migrates connections if this worker is
+   * overloaded. Resolves with the number of connections migrated.
+   */
+  public async rebalance(): Promise<number> {
+    this.sample()
+
+    const peers = (await this.getPeers()).map((peer) => ({ ...peer }))
+    if (peers.length === 0) {
+      return 0
+    }
+
+    let load = this.load
+    const average =
+      peers.reduce((sum, peer) => sum + peer.load, load) / (peers.length + 1)
+
+    if (load <= average * this.threshold) {
+      return 0
+    }
+
+    const candidates = [...this.connections]
+      .map(([connection, { rate }]) => ({ connection, rate }))
+      .filter(({ connection, rate }) => rate > 0 && connection.migratable)
+      .sort((a, b) => b.rate - a.rate)
+
+    let migrated = 0
+    while (migrated < this.maxMigrations) {
+      const peer = peers.reduce((a, b) => (b.load < a.load ? b : a))
+      const limit = (load - peer.load) / 2
+      const index = candidates.findIndex(({ rate }) => rate <= limit)
+      if (index === -1) {
+        break
+      }
+
+      const [{ connection, rate }] = candidates.splice(index, 1)
+      try {
+        await migrateConnection(connection, peer.target)
+      } catch (error) {
+        // One connection failing to move doesn't stop the others
+        this.emit('error', error)
+        continue
+      }
+
+      load -= rate
+      peer.load += rate
+      migrated++
+      this.migrations++
+      this.emit('migrated', connection, peer)
+    }
+
+    return migrated
+  }
+
+  private sample() {
+    const now = performance.now()
+    const seconds = (now - this.lastSample) / 1000
+    this.lastSample = now
+
+    if (seconds <= 0) {
+      return
+    }
+
+    for (const [connection, entry] of this.connections) {
+      const bytes = totalBytes(connection)
+      const rate = (bytes - entry.bytes) / seconds
+      entry.bytes = bytes
+      // Smooth out bursts so a single busy interval doesn't trigger a move
+      entry.rate = entry.rate === 0 ? rate : (entry.rate + rate) / 2
+    }
+  }
+}
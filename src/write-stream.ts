@@ -2,6 +2,9 @@ import { Writable } from 'stream'
 import type { ProcessProxyConnection } from './connection.js'
 
 export class WriteStream extends Writable {
+  /** Total number of bytes successfully written */
+  public bytesWritten = 0
+
   constructor(
     private readonly writeCb: (data: Buffer) => Promise<void>,
     private readonly closeCb: () => Promise<void>,
@@ -15,7 +18,10 @@ export class WriteStream extends Writable {
     callback: (error?: Error | null) => void,
   ): void {
     const buffer = Buffer.isBuffer(chunk) ? chunk : Buffer.from(chunk, encoding)
-    this.writeCb(buffer).then(() => callback(), callback)
+    this.writeCb(buffer).then(() => {
+      this.bytesWritten += buffer.length
+      callback()
+    }, callback)
   }
 
   _destroy(err: Error | null, callback: (error?: Error | null) => void): void {
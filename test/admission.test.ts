@@ -0,0 +1,168 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { AdmissionController } from '../src/index.js'
+import type { ProcessProxyConnection } from '../src/connection.js'
+import { createTestServer, spawnNativeProcess, waitForExit } from './helpers.js'
+
+describe('Admission control', () => {
+  it('should queue handshakes until a connection slot frees up', async () => {
+    const admission = new AdmissionController({ maxConnections: 1 })
+    const connections: ProcessProxyConnection[] = []
+    let notify = () => {}
+
+    const testServer = await createTestServer(
+      (connection) => {
+        connections.push(connection)
+        notify()
+      },
+      { admission },
+    )
+    const connected = (count: number) =>
+      new Promise<void>((resolve) => {
+        notify = () => connections.length >= count && resolve()
+        notify()
+      })
+
+    const first = spawnNativeProcess(testServer.port)
+    await connected(1)
+
+    const second = spawnNativeProcess(testServer.port)
+    while (admission.pending === 0) {
+      await new Promise((r) => setTimeout(r, 10))
+    }
+    assert.strictEqual(connections.length, 1, 'second proxy is held back')
+
+    await connections[0].exit(0)
+    await connected(2)
+    await connections[1].exit(0)
+
+    assert.strictEqual(await waitForExit(first), 0)
+    assert.strictEqual(await waitForExit(second), 0)
+    assert.strictEqual(admission.queued, 1)
+    assert.strictEqual(admission.rejected, 0)
+
+    await testServer.close()
+  })
+
+  it('should ask proxies to retry when the queue is full', async () => {
+    const admission = new AdmissionController({
+      maxConnections: 1,
+      maxQueued: 0,
+      retryAfter: 20,
+    })
+    const connections: ProcessProxyConnection[] = []
+    let notify = () => {}
+
+    const testServer = await createTestServer(
+      (connection) => {
+        connections.push(connection)
+        notify()
+      },
+      { admission },
+    )
+    const connected = (count: number) =>
+      new Promise<void>((resolve) => {
+        notify = () => connections.length >= count && resolve()
+        notify()
+      })
+
+    const first = spawnNativeProcess(testServer.port)
+    await connected(1)
+
+    const second = spawnNativeProcess(testServer.port)
+    while (admission.rejected < 2) {
+      await new Promise((r) => setTimeout(r, 10))
+    }
+    assert.strictEqual(connections.length, 1, 'second proxy is turned away')
+
+    // The proxy keeps retrying and gets in once the first one has gone
+    await connections[0].exit(0)
+    await connected(2)
+    await connections[1].exit(0)
+
+    assert.strictEqual(await waitForExit(first), 0)
+    assert.strictEqual(await waitForExit(second), 0)
+
+    await testServer.close()
+  })
+
+  it(
+    'should repeat notifications lost to a retry',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const admission = new AdmissionController({
+        maxConnections: 1,
+        maxQueued: 0,
+        retryAfter: 20,
+      })
+      const connections: ProcessProxyConnection[] = []
+      const disconnected: Promise<void>[] = []
+      let notify = () => {}
+
+      const testServer = await createTestServer(
+        (connection) => {
+          connections.push(connection)
+          disconnected.push(
+            new Promise((r) => connection.once('stdin-disconnected', r)),
+          )
+          notify()
+        },
+        { admission },
+      )
+      const connected = (count: number) =>
+        new Promise<void>((resolve) => {
+          notify = () => connections.length >= count && resolve()
+          notify()
+        })
+
+      const first = spawnNativeProcess(testServer.port)
+      await connected(1)
+
+      // Reported to the connection that's turned away
+      const second = spawnNativeProcess(testServer.port)
+      second.stdin.end()
+      while (admission.rejected < 2) {
+        await new Promise((r) => setTimeout(r, 10))
+      }
+
+      await connections[0].exit(0)
+      await connected(2)
+      await disconnected[1]
+      await connections[1].exit(0)
+
+      assert.strictEqual(await waitForExit(first), 0)
+      assert.strictEqual(await waitForExit(second), 0)
+
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should track data channels without counting them as connections',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const admission = new AdmissionController({ maxConnections: 1 })
+      const { promise, resolve } =
+        Promise.withResolvers<ProcessProxyConnection>()
+
+      const testServer = await createTestServer(resolve, {
+        admission,
+        dataChannels: true,
+      })
+      const child = spawnNativeProcess(testServer.port)
+      const connection = await promise
+
+      assert.strictEqual(connection.channelStreams.length, 3)
+      assert.strictEqual(admission.connections, 1)
+      assert.strictEqual(admission.dataChannels, 3)
+      assert.strictEqual(admission.queued, 0)
+
+      await connection.exit(0)
+      assert.strictEqual(await waitForExit(child), 0)
+      while (admission.dataChannels > 0) {
+        await new Promise((r) => setTimeout(r, 10))
+      }
+      await testServer.close()
+    },
+  )
+})
@@ -0,0 +1,74 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { createHash } from 'crypto'
+import { BufferPool } from '../src/index.js'
+import {
+  createConnectionHandler,
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+describe('BufferPool', () => {
+  it('should recycle slabs once every slice is released', () => {
+    const pool = new BufferPool(64, 1)
+    const a = pool.alloc(10)
+    const b = pool.alloc(20)
+    assert.strictEqual(a.buffer, b.buffer)
+    assert.strictEqual(b.byteOffset - a.byteOffset, 16, 'slices are aligned')
+
+    const c = pool.alloc(30)
+    assert.notStrictEqual(c.buffer, a.buffer)
+    assert.strictEqual(pool.slabsAllocated, 2)
+
+    pool.release(a)
+    pool.release(a)
+    pool.release(Buffer.alloc(10))
+    pool.alloc(30)
+    assert.strictEqual(pool.slabsRecycled, 0, 'b is still out')
+
+    pool.release(b)
+    assert.strictEqual(pool.alloc(30).buffer, a.buffer)
+    assert.strictEqual(pool.slabsRecycled, 1)
+  })
+
+  it('should allocate large buffers on their own', () => {
+    const pool = new BufferPool(64)
+    assert.strictEqual(pool.alloc(33).length, 33)
+    assert.strictEqual(pool.slabsAllocated, 0)
+  })
+
+  it('should carry stdin intact through released chunks', async () => {
+    const pool = new BufferPool(256 * 1024)
+    const payload = Buffer.alloc(4 * 1024 * 1024)
+    for (let i = 0; i < payload.length; i += 4) {
+      payload.writeUInt32LE(i, i)
+    }
+
+    const { promise, handler } = createConnectionHandler<string>(
+      async (connection, resolve) => {
+        // Keep reads small enough to be served from the pool
+        connection.stdin.maxReadSize = 64 * 1024
+        const hash = createHash('sha256')
+        for await (const chunk of connection.stdin) {
+          hash.update(chunk)
+          connection.stdin.release(chunk)
+        }
+        await connection.exit(0)
+        resolve(hash.digest('hex'))
+      },
+    )
+
+    const testServer = await createTestServer(handler, { bufferPool: pool })
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+    child.stdin.end(payload)
+
+    const expected = createHash('sha256').update(payload).digest('hex')
+    assert.strictEqual(await promise, expected)
+    assert.strictEqual(await waitForExit(child), 0)
+    // Released chunks free up the slab long before 4MB have gone through it
+    assert.ok(pool.slabsAllocated < payload.length / pool.slabSize)
+    await testServer.close()
+  })
+})
@@ -0,0 +1,152 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { spawn } from 'child_process'
+import { once } from 'events'
+import { pipeChildProcess, type PipeChildProcessResult } from '../src/index.js'
+import {
+  collectOutput,
+  createConnectionHandler,
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+// Echoes stdin to stdout, then reports the byte count on stderr
+const ECHO = `
+let n = 0
+process.stdin.on('data', (c) => (n += c.length)).pipe(process.stdout)
+process.stdin.on('end', () => {
+  process.stderr.write(n + '\\n')
+  process.exitCode = 3
+})
+`
+
+const pipeThroughEcho = async (framed: boolean) => {
+  const payload = Buffer.alloc(1024 * 1024, 'c')
+
+  const { promise, handler } = createConnectionHandler<PipeChildProcessResult>(
+    async (connection, resolve) => {
+      const child = spawn(process.execPath, ['-e', ECHO])
+      resolve(await pipeChildProcess(connection, child, { framed }))
+    },
+  )
+
+  const testServer = await createTestServer(handler)
+  const proxy = spawnNativeProcess(testServer.port)
+  const stdout = collectOutput(proxy.stdout)
+  const stderr = collectOutput(proxy.stderr)
+  proxy.stdin.end(payload)
+
+  const result = await promise
+  assert.strictEqual(result.exitCode, 3)
+  assert.strictEqual(await waitForExit(proxy), 3)
+  assert.strictEqual((await stdout).length, payload.length)
+  assert.strictEqual(await stderr, `${payload.length}\n`)
+  await testServer.close()
+  return result.transport
+}
+
+describe('pipeChildProcess', () => {
+  it(
+    'should forward over data channels',
+    { skip: process.platform === 'win32' },
+    async () => {
+      assert.strictEqual(await pipeThroughEcho(false), 'data-channels')
+    },
+  )
+
+  it('should forward over the command socket', async () => {
+    assert.strictEqual(await pipeThroughEcho(true), 'framed')
+  })
+
+  it('should reject when the child fails to spawn', async () => {
+    const { promise, handler } = createConnectionHandler<string>(
+      async (connection, resolve) => {
+        const child = spawn('process-proxy-does-not-exist')
+        const error = await pipeChildProcess(connection, child).catch(
+          (e: NodeJS.ErrnoException) => e.code!,
+        )
+        await connection.exit(1)
+        resolve(error as string)
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const proxy = spawnNativeProcess(testServer.port)
+    proxy.stdout.resume()
+
+    assert.strictEqual(await promise, 'ENOENT')
+    assert.strictEqual(await waitForExit(proxy), 1)
+    await testServer.close()
+  })
+
+  it('should reject a child that failed to spawn earlier', async () => {
+    const child = spawn('process-proxy-does-not-exist')
+    await once(child, 'error')
+
+    const { promise, handler } = createConnectionHandler<string>(
+      async (connection, resolve) => {
+        const error = await pipeChildProcess(connection, child).catch(
+          (e: NodeJS.ErrnoException) => e.code!,
+        )
+        await connection.exit(1)
+        resolve(error as string)
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const proxy = spawnNativeProcess(testServer.port)
+    proxy.stdout.resume()
+
+    assert.strictEqual(await promise, 'ENOENT')
+    assert.strictEqual(await waitForExit(proxy), 1)
+    await testServer.close()
+  })
+
+  it('should exit with the code of an already closed child', async () => {
+    const child = spawn(process.execPath, ['-e', 'process.exitCode = 5'])
+    child.stdout.resume()
+    child.stderr.resume()
+    await once(child, 'close')
+
+    const { promise, handler } = createConnectionHandler<number>(
+      async (connection, resolve) => {
+        resolve((await pipeChildProcess(connection, child)).exitCode)
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const proxy = spawnNativeProcess(testServer.port)
+    proxy.stdout.resume()
+    proxy.stdin.end()
+
+    assert.strictEqual(await promise, 5)
+    assert.strictEqual(await waitForExit(proxy), 5)
+    await testServer.close()
+  })
+
+  it('should not crash on child errors after spawning', async () => {
+    const { promise, handler } = createConnectionHandler<number>(
+      async (connection, resolve) => {
+        const child = spawn(process.execPath, ['-e', ECHO])
+        const result = pipeChildProcess(connection, child)
+        // As emitted when the child can't be killed
+        const error = new Error('kill EPERM')
+        child.once('spawn', () =>
+          setImmediate(() => child.emit('error', error)),
+        )
+        resolve((await result).exitCode)
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const proxy = spawnNativeProcess(testServer.port)
+    proxy.stdout.resume()
+    proxy.stderr.resume()
+    proxy.stdin.end()
+
+    assert.strictEqual(await promise, 3)
+    assert.strictEqual(await waitForExit(proxy), 3)
+    await testServer.close()
+  })
+})
@@ -0,0 +1,69 @@
+// Counts the heap allocations of the process it's preloaded into with
+// LD_PRELOAD and writes the total to the file named by
+// ALLOCATION_COUNT_FILE when the process exits. Forwards to glibc's own
+// allocator so only works against glibc. Used by test/memory.test.ts.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+static unsigned long g_allocations = 0;
+
+static void count_allocation(void) {
+    __atomic_add_fetch(&g_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    *ptr = memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+__attribute__((destructor)) static void report_allocations(void) {
+    const char* path = getenv("ALLOCATION_COUNT_FILE");
+    if (!path) {
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    char count[32];
+    int len = snprintf(count, sizeof(count), "%lu\n", g_allocations);
+    if (write(fd, count, (size_t)len) < 0) {
+        // Nothing to be done, the test fails on the missing count
+    }
+    close(fd);
+}
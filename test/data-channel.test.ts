@@ -0,0 +1,135 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import {
+  collectOutput,
+  createConnectionHandler,
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+describe('Data channels', () => {
+  it(
+    'should carry all streams over their own channels',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const payload = Buffer.alloc(2 * 1024 * 1024, 'd')
+
+      const { promise, handler } = createConnectionHandler<number>(
+        async (connection, resolve) => {
+          let received = 0
+          for await (const chunk of connection.stdin) {
+            received += chunk.length
+            await new Promise<void>((r) => connection.stdout.write(chunk, r))
+          }
+
+          // Commands still work alongside the channels
+          assert.deepStrictEqual((await connection.getArgs()).slice(1), [
+            'test',
+          ])
+          await new Promise<void>((r) => connection.stderr.write('done\n', r))
+          await connection.exit(5)
+          resolve(received)
+        },
+      )
+
+      const testServer = await createTestServer(handler, {
+        dataChannels: true,
+      })
+      const child = spawnNativeProcess(testServer.port)
+      const stdout = collectOutput(child.stdout)
+      const stderr = collectOutput(child.stderr)
+      child.stdin.end(payload)
+
+      assert.strictEqual(await promise, payload.length)
+      assert.strictEqual(await waitForExit(child), 5)
+      assert.strictEqual((await stdout).length, payload.length)
+      assert.strictEqual(await stderr, 'done\n')
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should keep earlier framed writes ahead of channel writes',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const { promise, handler } = createConnectionHandler<void>(
+        async (connection, resolve) => {
+          connection.stdout.write('framed\n')
+          await connection.openDataChannels(['stdout'])
+          assert.strictEqual(connection.stats.stdoutBytes, 7)
+
+          connection.stdout.end('channel\n')
+          await connection.exit(0)
+          resolve()
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      const child = spawnNativeProcess(testServer.port)
+      const output = collectOutput(child.stdout)
+
+      await promise
+      assert.strictEqual(await waitForExit(child), 0)
+      assert.strictEqual(await output, 'framed\nchannel\n')
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should answer commands after the server resets the stdin channel',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const { promise, handler } = createConnectionHandler<void>(
+        async (connection, resolve) => {
+          // Destroying stdin with data still buffered resets its channel
+          for await (const _ of connection.stdin) {
+            break
+          }
+          await connection.exit(7)
+          resolve()
+        },
+      )
+
+      const testServer = await createTestServer(handler, {
+        dataChannels: ['stdin'],
+      })
+      const child = spawnNativeProcess(testServer.port)
+      child.stdout.resume()
+      // Stdin stays open, the proxy mustn't block reading it
+      child.stdin.write(Buffer.alloc(100 * 1024, 'r'))
+
+      await promise
+      assert.strictEqual(await waitForExit(child), 7)
+      child.stdin.destroy()
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should reject when a channel times out before the proxy answers',
+    { skip: process.platform === 'win32' },
+    async (t) => {
+      const { promise, handler } = createConnectionHandler<string>(
+        async (connection, resolve) => {
+          t.mock.method(connection['dataChannels']!, 'expect', () =>
+            Promise.reject(new Error('Timed out waiting for data channel')),
+          )
+          const error = await connection
+            .openDataChannels(['stdout'])
+            .catch((e: Error) => e.message)
+          await connection.exit(0)
+          resolve(error as string)
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      const child = spawnNativeProcess(testServer.port)
+      child.stdout.resume()
+
+      assert.strictEqual(await promise, 'Timed out waiting for data channel')
+      assert.strictEqual(await waitForExit(child), 0)
+      await testServer.close()
+    },
+  )
+})
@@ -0,0 +1,105 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { jsFraming, nativeFraming, type Framing } from '../src/index.js'
+import {
+  createConnectionHandler,
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+const encodeList = (list: string[]) =>
+  Buffer.concat(
+    list.flatMap((str) => {
+      const bytes = Buffer.from(str, 'utf8')
+      const length = Buffer.alloc(4)
+      length.writeUInt32LE(bytes.length, 0)
+      return [length, bytes]
+    }),
+  )
+
+const implementations: [string, Framing | undefined][] = [
+  ['JavaScript', jsFraming],
+  ['native', nativeFraming],
+]
+
+for (const [name, framing] of implementations) {
+  describe(`Framing (${name})`, { skip: !framing && 'addon not built' }, () => {
+    it('should encode command headers', () => {
+      const header = Buffer.alloc(5)
+      framing!.encodeHeader(header, 0x02, 0x12345678)
+      assert.deepStrictEqual([...header], [0x02, 0x78, 0x56, 0x34, 0x12])
+
+      framing!.encodeHeader(header, 0x03, -1)
+      assert.deepStrictEqual([...header], [0x03, 0xff, 0xff, 0xff, 0xff])
+
+      const short = Buffer.alloc(1)
+      framing!.encodeHeader(short, 0x07, undefined)
+      assert.strictEqual(short[0], 0x07)
+    })
+
+    it('should decode string lists up to the first incomplete item', () => {
+      const list = ['', 'a', 'héllo wörld', 'x'.repeat(1000)]
+      const block = Buffer.concat([Buffer.alloc(3), encodeList(list)])
+
+      const items: string[] = ['existing']
+      const end = framing!.decodeStringList(block, 3, 10, items)
+      assert.strictEqual(end, block.length)
+      assert.deepStrictEqual(items, ['existing', ...list])
+
+      const partial: string[] = []
+      const cut = block.subarray(0, block.length - 1)
+      const last = encodeList(list.slice(3)).length
+      assert.strictEqual(
+        framing!.decodeStringList(cut, 3, 10, partial),
+        block.length - last,
+      )
+      assert.deepStrictEqual(partial, list.slice(0, 3))
+
+      const counted: string[] = []
+      assert.strictEqual(framing!.decodeStringList(block, 3, 1, counted), 7)
+      assert.deepStrictEqual(counted, [''])
+    })
+
+    it('should parse environment variables', () => {
+      const env = framing!.parseEnv(['A=1', 'B==2', 'NOPE', 'C=', 'É=ü'])
+      assert.deepStrictEqual(env, { A: '1', B: '=2', C: '', É: 'ü' })
+    })
+  })
+}
+
+describe('Native framing', { skip: !nativeFraming }, () => {
+  it('should carry a connection', async (t) => {
+    const encode = t.mock.method(nativeFraming!, 'encodeHeader')
+    const decode = t.mock.method(nativeFraming!, 'decodeStringList')
+    const parseEnv = t.mock.method(nativeFraming!, 'parseEnv')
+
+    const { promise, handler } = createConnectionHandler<
+      [string[], Record<string, string>]
+    >(async (connection, resolve) => {
+      assert.strictEqual(connection['framing'], nativeFraming)
+      const result = await Promise.all([
+        connection.getArgs(),
+        connection.getEnv(),
+      ])
+      await connection.exit(0)
+      resolve(result)
+    })
+
+    const testServer = await createTestServer(handler, { nativeFraming: true })
+    const child = spawnNativeProcess(testServer.port, ['test', 'framing'], {
+      FRAMING_TEST: 'a=b',
+    })
+    child.stdout.resume()
+
+    const [args, env] = await promise
+    assert.deepStrictEqual(args.slice(1), ['test', 'framing'])
+    assert.strictEqual(env.FRAMING_TEST, 'a=b')
+    assert.strictEqual(await waitForExit(child), 0)
+    await testServer.close()
+
+    assert.ok(encode.mock.callCount() >= 3, 'commands are encoded natively')
+    assert.ok(decode.mock.callCount() >= 2, 'blocks are decoded natively')
+    assert.strictEqual(parseEnv.mock.callCount(), 1)
+  })
+})
@@ -85,6 +85,32 @@ describe('Handshake', () => {
     await testServer.close()
   })
 
+  it('should accept the previous protocol version', async () => {
+    const { promise, resolve } = Promise.withResolvers<number>()
+
+    const testServer = await createTestServer((connection) => {
+      // The client hangs up without exiting, ignore the reset
+      connection.on('error', () => {})
+      resolve(connection.protocolVersion)
+    })
+
+    const client = new net.Socket()
+    await new Promise<void>((resolve, reject) => {
+      client.connect(testServer.port, '127.0.0.1', resolve)
+      client.on('error', reject)
+    })
+    client.resume()
+
+    const handshake = Buffer.alloc(146)
+    handshake.write('ProcessProxy 0002 ', 0, 'utf8')
+    client.write(handshake)
+
+    assert.strictEqual(await promise, 2)
+
+    client.destroy()
+    await testServer.close()
+  })
+
   it('should reject connection with invalid protocol header', async () => {
     let connectionReceived = false
 
@@ -0,0 +1,82 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { InternCache } from '../src/index.js'
+import type { ProcessProxyConnection } from '../src/connection.js'
+import { createTestServer, spawnNativeProcess, waitForExit } from './helpers.js'
+
+describe('Interning', () => {
+  it('should share identical args and env between connections', async () => {
+    const intern = new InternCache()
+    const connections: ProcessProxyConnection[] = []
+    let notify = () => {}
+
+    const testServer = await createTestServer(
+      (connection) => {
+        connections.push(connection)
+        notify()
+      },
+      { intern },
+    )
+    const connected = (count: number) =>
+      new Promise<void>((resolve) => {
+        notify = () => connections.length >= count && resolve()
+        notify()
+      })
+
+    // Spawned one at a time so connections arrive in a known order
+    const children = []
+    for (const value of ['shared', 'shared', 'other']) {
+      const child = spawnNativeProcess(testServer.port, ['test'], {
+        INTERN_TEST: value,
+      })
+      child.stdout.resume()
+      children.push(child)
+      await connected(children.length)
+    }
+
+    const [first, second, other] = connections
+    const firstEnv = await first.getEnv()
+    const firstArgs = await first.getArgs()
+    assert.strictEqual(firstEnv.INTERN_TEST, 'shared')
+    assert.ok(Object.isFrozen(firstEnv))
+    assert.strictEqual(intern.misses, 2)
+
+    assert.strictEqual(await second.getEnv(), firstEnv)
+    assert.strictEqual(await second.getArgs(), firstArgs)
+    assert.strictEqual(intern.hits, 2)
+
+    const otherEnv = await other.getEnv()
+    assert.notStrictEqual(otherEnv, firstEnv)
+    assert.strictEqual(otherEnv.INTERN_TEST, 'other')
+    assert.strictEqual(intern.size, 3)
+
+    for (const connection of connections) {
+      await connection.exit(0)
+    }
+    for (const child of children) {
+      assert.strictEqual(await waitForExit(child), 0)
+    }
+    await testServer.close()
+  })
+
+  it('should freeze blocks that could not be interned', async () => {
+    const intern = new InternCache()
+    const { promise, resolve } = Promise.withResolvers<ProcessProxyConnection>()
+    const testServer = await createTestServer(resolve, { intern })
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+
+    const connection = await promise
+    // A digest the block doesn't hash to, as if it didn't survive decoding
+    connection['getBlockDigest'] = async () => Buffer.alloc(32)
+
+    const env = await connection.getEnv()
+    assert.ok(Object.isFrozen(env))
+    assert.ok(Object.isFrozen(await connection.getArgs()))
+    assert.strictEqual(intern.size, 0)
+
+    await connection.exit(0)
+    assert.strictEqual(await waitForExit(child), 0)
+    await testServer.close()
+  })
+})
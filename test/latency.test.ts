@@ -0,0 +1,113 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import {
+  BufferPool,
+  LatencyTracker,
+  type ProcessProxyLatency,
+} from '../src/index.js'
+import {
+  createConnectionHandler,
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+describe('Latency probes', () => {
+  it('should estimate the clock offset from the best ping', () => {
+    const tracker = new LatencyTracker()
+    assert.strictEqual(tracker.latency, undefined)
+
+    // Proxy clock 1ms ahead, 50µs each way and 10µs spent in the proxy
+    tracker.addPing(0n, 1_050_000n, 1_060_000n, 110_000n)
+    // A slower round trip doesn't replace the estimate
+    tracker.addPing(0n, 1_500_000n, 1_500_000n, 1_000_000n)
+
+    const latency = tracker.latency!
+    assert.strictEqual(latency.rtt, 0.1)
+    assert.strictEqual(latency.clockOffset, 1)
+
+    tracker.addStdinRead(0n, 1_200_000n, 300_000n)
+    assert.strictEqual(tracker.latency!.stdin.request.last, 0.2)
+    assert.strictEqual(tracker.latency!.stdin.delivery.last, 0.1)
+
+    tracker.addStdoutWrite(0n, 100_000n, 1_400_000n, 500_000n)
+    const { stdout } = tracker.latency!
+    assert.strictEqual(stdout.queued.last, 0.1)
+    assert.strictEqual(stdout.transit.last, 0.3)
+    assert.strictEqual(stdout.total.last, 0.4)
+    assert.strictEqual(stdout.ack.last, 0.1)
+  })
+
+  it('should break down stdin and stdout latency', async () => {
+    const { promise, handler } = createConnectionHandler<
+      [string, ProcessProxyLatency]
+    >(async (connection, resolve) => {
+      const ping = await connection.ping()
+      assert.ok(ping.rtt >= 0)
+      if (process.platform === 'linux') {
+        // Both ends use CLOCK_MONOTONIC
+        assert.ok(Math.abs(ping.clockOffset) <= ping.rtt + 1)
+      }
+
+      await connection.enableLatencyProbes()
+      connection.stdin.once('data', async (chunk: Buffer) => {
+        await new Promise<void>((resolve) =>
+          connection.stdout.write(chunk, () => resolve()),
+        )
+        await connection.disableLatencyProbes()
+        await connection.exit(0)
+        resolve([chunk.toString(), connection.latency!])
+      })
+    })
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    let output = ''
+    child.stdout.on('data', (chunk) => (output += chunk))
+    child.stdin.write('hello')
+
+    const [chunk, latency] = await promise
+    assert.strictEqual(chunk, 'hello', 'the timestamp is stripped')
+    assert.strictEqual(latency.stdin.delivery.count, 1)
+    assert.strictEqual(latency.stdout.total.count, 1)
+    assert.ok(latency.stdout.total.last >= latency.stdout.queued.last)
+    assert.strictEqual(await waitForExit(child), 0)
+    assert.strictEqual(output, 'hello')
+    await testServer.close()
+  })
+
+  it('should hand stamped stdin chunks back to the pool', async () => {
+    const pool = new BufferPool(256 * 1024)
+    const payload = Buffer.alloc(4 * 1024 * 1024, 's')
+
+    const { promise, handler } = createConnectionHandler<number>(
+      async (connection, resolve) => {
+        await connection.enableLatencyProbes(['stdin'])
+        // Keep reads small enough to be served from the pool
+        connection.stdin.maxReadSize = 64 * 1024
+        let received = 0
+        for await (const chunk of connection.stdin) {
+          assert.ok(chunk.equals(payload.subarray(0, chunk.length)))
+          received += chunk.length
+          connection.stdin.release(chunk)
+        }
+        await connection.exit(0)
+        resolve(received)
+      },
+    )
+
+    const testServer = await createTestServer(handler, { bufferPool: pool })
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+    child.stdin.end(payload)
+
+    assert.strictEqual(await promise, payload.length)
+    assert.strictEqual(await waitForExit(child), 0)
+    // Released chunks free up the slab long before 4MB have gone through it
+    assert.ok(
+      pool.slabsAllocated < payload.length / pool.slabSize,
+      `allocated ${pool.slabsAllocated} slabs`,
+    )
+    await testServer.close()
+  })
+})
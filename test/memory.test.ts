@@ -0,0 +1,220 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { execFileSync } from 'child_process'
+import { mkdtempSync, readFileSync, rmSync } from 'fs'
+import { tmpdir } from 'os'
+import { join } from 'path'
+import { fileURLToPath } from 'url'
+import { setFlagsFromString } from 'v8'
+import { runInNewContext } from 'vm'
+import type { ProcessProxyConnection } from '../src/index.js'
+import {
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+  createConnectionHandler,
+} from './helpers.js'
+
+const getRss = (pid: number) => {
+  const status = readFileSync(`/proc/${pid}/status`, 'utf8')
+  return Number(/^VmRSS:\s+(\d+)\s+kB/m.exec(status)![1])
+}
+
+setFlagsFromString('--expose-gc')
+const gc = runInNewContext('gc') as () => void
+
+// Builds the allocation counting library preloaded into the proxy, or returns
+// undefined when there's no C compiler or no glibc to interpose
+const buildAllocationCounter = (dir: string) => {
+  if (process.platform !== 'linux') {
+    return undefined
+  }
+
+  const source = fileURLToPath(new URL('count-allocations.c', import.meta.url))
+  const library = join(dir, 'count-allocations.so')
+  try {
+    execFileSync('cc', ['-shared', '-fPIC', '-O2', '-o', library, source], {
+      stdio: 'ignore',
+    })
+    return library
+  } catch {
+    return undefined
+  }
+}
+
+// Runs every steady-state command `iterations` times against a proxy with
+// the allocation counter preloaded, returns the allocations it made in total
+const countAllocations = async (
+  library: string,
+  countFile: string,
+  iterations: number,
+) => {
+  const chunk = Buffer.alloc(64 * 1024, 'x')
+  const stdinPayload = Buffer.alloc(iterations * 16 * 1024, 'y')
+
+  const { promise, handler } = createConnectionHandler<void>(
+    async (connection: ProcessProxyConnection, resolve) => {
+      let received = 0
+      const stdinDone = new Promise<void>((resolve) => {
+        connection.stdin.on('data', (data) => (received += data.length))
+        connection.stdin.on('end', resolve)
+      })
+
+      for (let i = 0; i < iterations; i++) {
+        await new Promise<void>((r) => connection.stdout.write(chunk, r))
+        await connection.isStdinConnected()
+        await connection.getArgs()
+        await connection.getEnv()
+        await connection.getCwd()
+        await connection.ping()
+      }
+
+      await stdinDone
+      assert.strictEqual(received, stdinPayload.length)
+      await connection.exit(0)
+      resolve()
+    },
+  )
+
+  const testServer = await createTestServer(handler)
+  const child = spawnNativeProcess(testServer.port, ['test'], {
+    LD_PRELOAD: library,
+    ALLOCATION_COUNT_FILE: countFile,
+  })
+  child.stdout.resume()
+  child.stdin.end(stdinPayload)
+
+  await promise
+  assert.strictEqual(await waitForExit(child), 0)
+  await testServer.close()
+  return Number(readFileSync(countFile, 'utf8'))
+}
+
+describe('Memory usage', () => {
+  it('should not allocate in the proxy command loop', async (t) => {
+    const dir = mkdtempSync(join(tmpdir(), 'process-proxy-'))
+    t.after(() => rmSync(dir, { recursive: true, force: true }))
+
+    const library = buildAllocationCounter(dir)
+    if (!library) {
+      t.skip('requires glibc and a C compiler')
+      return
+    }
+
+    // Start-up allocates, e.g. stdio's own buffers, but the same amount no
+    // matter how many commands follow
+    const countFile = join(dir, 'allocations')
+    const baseline = await countAllocations(library, countFile, 10)
+    const loaded = await countAllocations(library, countFile, 100)
+    assert.ok(baseline > 0, 'allocations are counted')
+    assert.strictEqual(
+      loaded - baseline,
+      0,
+      `${loaded - baseline} allocations in 90 extra rounds of commands`,
+    )
+  })
+
+  // RSS only reveals memory the proxy holds on to, allocations that are freed
+  // again are caught by the test above
+  it('should keep the proxy RSS flat while processing commands', async (t) => {
+    // VmRSS is only readily available on Linux
+    if (process.platform !== 'linux') {
+      t.skip('requires /proc')
+      return
+    }
+
+    const chunk = Buffer.alloc(64 * 1024, 'x')
+    const stdinPayload = Buffer.alloc(2 * 1024 * 1024, 'y')
+    let pid = 0
+
+    const { promise, handler } = createConnectionHandler<[number, number]>(
+      async (connection, resolve) => {
+        const write = (data: Buffer) =>
+          new Promise<void>((resolve, reject) =>
+            connection.stdout.write(data, (err) =>
+              err ? reject(err) : resolve(),
+            ),
+          )
+
+        // Warm up with a write larger than the largest stdin read so that all
+        // of the proxy's preallocated buffers have been faulted in.
+        await write(Buffer.alloc(2 * 1024 * 1024, 'w'))
+        const before = getRss(pid)
+
+        let received = 0
+        const stdinDone = new Promise<void>((resolve) => {
+          connection.stdin.on('data', (data) => (received += data.length))
+          connection.stdin.on('end', resolve)
+        })
+
+        for (let i = 0; i < 200; i++) {
+          await write(chunk)
+          await connection.isStdinConnected()
+        }
+
+        await stdinDone
+        assert.strictEqual(received, stdinPayload.length)
+
+        const after = getRss(pid)
+        await connection.exit(0)
+        resolve([before, after])
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    pid = child.pid!
+    child.stdout.resume()
+    child.stdin.end(stdinPayload)
+
+    const [before, after] = await promise
+    await waitForExit(child)
+    await testServer.close()
+
+    assert.ok(
+      after - before < 256,
+      `proxy RSS grew from ${before}kB to ${after}kB`,
+    )
+  })
+
+  // Heap measured after a full GC, so this catches leaks but not garbage
+  // produced per command, see bench/dispatcher.bench.ts for allocation rates
+  it('should not retain server heap per command', async () => {
+    const data = Buffer.alloc(64, 'x')
+
+    const { promise, handler } = createConnectionHandler<number>(
+      async (connection, resolve) => {
+        const run = async (iterations: number) => {
+          for (let i = 0; i < iterations; i++) {
+            await connection.isStdinConnected()
+            await connection['writeStream'](0x03, data)
+          }
+        }
+
+        await run(500)
+        gc()
+        const before = process.memoryUsage().heapUsed
+
+        await run(5000)
+        gc()
+        const retained = process.memoryUsage().heapUsed - before
+
+        await connection.exit(0)
+        resolve(retained)
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+
+    const retained = await promise
+    await waitForExit(child)
+    await testServer.close()
+
+    assert.ok(
+      retained < 256 * 1024,
+      `retained ${retained} bytes across 10000 commands`,
+    )
+  })
+})
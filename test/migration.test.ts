@@ -0,0 +1,199 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import {
+  ConnectionRebalancer,
+  ProcessProxyConnection,
+  receiveConnection,
+  type MigrationTarget,
+} from '../src/index.js'
+import {
+  createTestServer,
+  createConnectionHandler,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+describe('Connection migration', () => {
+  it('should carry on a connection after detaching it', async () => {
+    const { promise, handler } = createConnectionHandler<string>(
+      async (connection, resolve) => {
+        await connection.getArgs()
+        await new Promise<void>((r) => connection.stdout.write('before\n', r))
+        const onData = () => {}
+        connection.stdin.on('data', onData)
+
+        const { socket, state } = await connection.detach()
+        assert.strictEqual(connection.closed, true)
+        assert.ok(
+          connection.stdin.listeners('data').includes(onData),
+          "the application's listeners should be left alone",
+        )
+        await assert.rejects(connection.getCwd(), /migrated/)
+
+        const moved = ProcessProxyConnection.attach(socket, state)
+        assert.strictEqual(moved.token, connection.token)
+        assert.strictEqual(moved.stats.commands, 2)
+        assert.strictEqual(moved.stats.stdoutBytes, 7)
+
+        await new Promise<void>((r) => moved.stdout.write('after\n', r))
+        const args = await moved.getArgs()
+        await moved.exit(0)
+        resolve(args.slice(1).join(' '))
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port, ['test', 'migrate'])
+    const output: Buffer[] = []
+    child.stdout.on('data', (chunk) => output.push(chunk))
+
+    assert.strictEqual(await promise, 'test migrate')
+    assert.strictEqual(await waitForExit(child), 0)
+    assert.strictEqual(Buffer.concat(output).toString(), 'before\nafter\n')
+    await testServer.close()
+  })
+
+  it('should hand over stdin that has not been consumed', async () => {
+    const { promise, handler } = createConnectionHandler<string>(
+      async (connection, resolve) => {
+        // Let the stream buffer the input without anybody consuming it. A
+        // paused stream wouldn't poll for it.
+        connection.stdin.read(0)
+        while (connection.stdin.readableLength === 0) {
+          await new Promise((r) => setTimeout(r, 10))
+        }
+
+        const { socket, state } = await connection.detach()
+        const moved = ProcessProxyConnection.attach(socket, state)
+
+        const chunks: Buffer[] = []
+        for await (const chunk of moved.stdin) {
+          chunks.push(chunk)
+        }
+        await moved.exit(0)
+        resolve(Buffer.concat(chunks).toString())
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+    child.stdin.end('hello')
+
+    assert.strictEqual(await promise, 'hello')
+    await waitForExit(child)
+    await testServer.close()
+  })
+
+  it('should move busy connections to less loaded peers', async () => {
+    const received: ProcessProxyConnection[] = []
+    const target: MigrationTarget = {
+      send(message, handle, callback) {
+        received.push(receiveConnection(message, handle)!.connection)
+        callback?.(null)
+        return true
+      },
+    }
+    const rebalancer = new ConnectionRebalancer({
+      getPeers: () => [{ load: 0, target }],
+    })
+
+    const connections: ProcessProxyConnection[] = []
+    const { promise: connected, resolve } = Promise.withResolvers<void>()
+    const testServer = await createTestServer((connection) => {
+      connections.push(connection)
+      rebalancer.add(connection)
+      if (connections.length === 2) {
+        resolve()
+      }
+    })
+    const children = [
+      spawnNativeProcess(testServer.port),
+      spawnNativeProcess(testServer.port),
+    ]
+    children.forEach((child) => child.stdout.resume())
+    await connected
+
+    const write = (connection: ProcessProxyConnection, size: number) =>
+      new Promise<void>((r) => connection.stdout.write(Buffer.alloc(size), r))
+
+    await write(connections[0], 64 * 1024)
+    await write(connections[1], 16 * 1024)
+
+    // A single connection that carries most of the load stays put, moving it
+    // would only shift the imbalance to the peer.
+    assert.strictEqual(await rebalancer.rebalance(), 1)
+    assert.strictEqual(received.length, 1)
+    assert.strictEqual(connections[1].closed, true)
+    assert.strictEqual(connections[0].closed, false)
+    assert.strictEqual(rebalancer.migrations, 1)
+
+    await connections[0].exit(0)
+    await received[0].exit(0)
+    for (const child of children) {
+      assert.strictEqual(await waitForExit(child), 0)
+    }
+    await testServer.close()
+  })
+
+  it(
+    'should skip connections that cannot be moved',
+    { skip: process.platform === 'win32' },
+    async (t) => {
+      const received: ProcessProxyConnection[] = []
+      const target: MigrationTarget = {
+        send(message, handle, callback) {
+          received.push(receiveConnection(message, handle)!.connection)
+          callback?.(null)
+          return true
+        },
+      }
+      const rebalancer = new ConnectionRebalancer({
+        getPeers: () => [{ load: 0, target }],
+      })
+      const errors: Error[] = []
+      rebalancer.on('error', (error) => errors.push(error))
+
+      const connections: ProcessProxyConnection[] = []
+      const { promise: connected, resolve } = Promise.withResolvers<void>()
+      const testServer = await createTestServer((connection) => {
+        connections.push(connection)
+        rebalancer.add(connection)
+        if (connections.length === 3) {
+          resolve()
+        }
+      })
+      const children = [1, 2, 3].map(() => spawnNativeProcess(testServer.port))
+      children.forEach((child) => child.stdout.resume())
+      await connected
+
+      // The busiest connection has a data channel, the next fails to detach
+      const [withChannel, failing, movable] = connections
+      await withChannel.openDataChannels(['stdout'])
+      t.mock.method(failing, 'detach', () =>
+        Promise.reject(new Error('Detach failed')),
+      )
+
+      const write = (connection: ProcessProxyConnection, size: number) =>
+        new Promise<void>((r) => connection.stdout.write(Buffer.alloc(size), r))
+
+      await write(withChannel, 30 * 1024)
+      await write(failing, 25 * 1024)
+      await write(movable, 20 * 1024)
+
+      assert.strictEqual(await rebalancer.rebalance(), 1)
+      assert.deepStrictEqual(errors.map((e) => e.message), ['Detach failed'])
+      assert.strictEqual(movable.closed, true)
+      assert.strictEqual(withChannel.closed, false)
+      assert.strictEqual(failing.closed, false)
+
+      await withChannel.exit(0)
+      await failing.exit(0)
+      await received[0].exit(0)
+      for (const child of children) {
+        assert.strictEqual(await waitForExit(child), 0)
+      }
+      await testServer.close()
+    },
+  )
+})
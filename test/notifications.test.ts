@@ -0,0 +1,83 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import {
+  createTestServer,
+  createConnectionHandler,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+describe('Notifications', { skip: process.platform === 'win32' }, () => {
+  it('should emit stdin-disconnected when stdin reaches EOF', async () => {
+    const { promise, handler } = createConnectionHandler<void>(
+      async (connection, resolve) => {
+        await new Promise<void>((r) => connection.once('stdin-disconnected', r))
+        await connection.exit(0)
+        resolve()
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+    child.stdin.end()
+
+    await promise
+    await waitForExit(child)
+    await testServer.close()
+  })
+
+  it('should not announce EOF before buffered stdin has been read', async () => {
+    const { promise, handler } = createConnectionHandler<string>(
+      async (connection, resolve) => {
+        let disconnected = false
+        connection.on('stdin-disconnected', () => (disconnected = true))
+
+        // Keep the connection busy until the proxy has seen the EOF
+        await new Promise((r) => setTimeout(r, 100))
+        assert.strictEqual(disconnected, false, 'data still unread')
+
+        const chunks: Buffer[] = []
+        for await (const chunk of connection.stdin) {
+          chunks.push(chunk)
+        }
+
+        await connection.exit(0)
+        resolve(Buffer.concat(chunks).toString())
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    child.stdout.resume()
+    child.stdin.end('hello')
+
+    assert.strictEqual(await promise, 'hello')
+    await waitForExit(child)
+    await testServer.close()
+  })
+
+  it('should emit stdout-broken when the stdout reader goes away', async () => {
+    const { promise, handler } = createConnectionHandler<boolean>(
+      async (connection, resolve) => {
+        const broken = new Promise<void>((r) =>
+          connection.once('stdout-broken', r),
+        )
+        child.stdout.destroy()
+        await broken
+
+        // The connection remains usable after a notification
+        const connected = await connection.isStdinConnected()
+        await connection.exit(0)
+        resolve(connected)
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+
+    assert.strictEqual(await promise, true)
+    await waitForExit(child)
+    await testServer.close()
+  })
+})
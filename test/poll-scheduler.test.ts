@@ -0,0 +1,130 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { PollScheduler } from '../src/index.js'
+import {
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+  delay,
+} from './helpers.js'
+import type { ProcessProxyConnection } from '../src/connection.js'
+import { ReadStream } from '../src/read-stream.js'
+
+describe('PollScheduler', () => {
+  it('should coalesce callbacks due in the same tick', async () => {
+    const scheduler = new PollScheduler(20)
+    const fired: number[] = []
+
+    for (let i = 0; i < 100; i++) {
+      scheduler.schedule(() => fired.push(i), 20)
+    }
+
+    await delay(60)
+
+    assert.strictEqual(fired.length, 100, 'all callbacks should have fired')
+    assert.strictEqual(scheduler.polls, 100)
+    assert.ok(
+      scheduler.ticks <= 2,
+      `expected at most 2 wakeups, got ${scheduler.ticks}`,
+    )
+  })
+
+  it('should not invoke callbacks before their delay', async () => {
+    const scheduler = new PollScheduler(10)
+    const start = performance.now()
+    const elapsed = await new Promise<number>((resolve) =>
+      scheduler.schedule(() => resolve(performance.now() - start), 50),
+    )
+
+    assert.ok(elapsed >= 49, `fired after ${elapsed}ms`)
+  })
+
+  it('should fire callbacks in order of their due time', async () => {
+    const scheduler = new PollScheduler(10)
+    const fired: string[] = []
+
+    scheduler.schedule(() => fired.push('slow'), 80)
+    scheduler.schedule(() => fired.push('fast'), 10)
+    scheduler.schedule(() => fired.push('medium'), 40)
+
+    await delay(120)
+
+    assert.deepStrictEqual(fired, ['fast', 'medium', 'slow'])
+  })
+
+  it('should not invoke unscheduled callbacks', async () => {
+    const scheduler = new PollScheduler(10)
+    const fired: string[] = []
+    const cancelled = () => fired.push('cancelled')
+
+    scheduler.schedule(cancelled, 10)
+    scheduler.schedule(() => fired.push('kept'), 10)
+    scheduler.unschedule(cancelled)
+
+    await delay(40)
+
+    assert.deepStrictEqual(fired, ['kept'])
+  })
+
+  it('should stop polling a paused stream until it is resumed', async () => {
+    const scheduler = new PollScheduler(10)
+    let reads = 0
+    const stream = new ReadStream(
+      async () => {
+        reads++
+        return Buffer.alloc(0)
+      },
+      async () => {},
+      scheduler,
+    )
+
+    stream.resume()
+    await delay(100)
+    assert.ok(reads > 1, `expected polls while flowing, got ${reads}`)
+
+    stream.pause()
+    const pausedReads = reads
+    await delay(250)
+    assert.strictEqual(reads, pausedReads, 'a paused stream should not poll')
+
+    stream.resume()
+    await delay(50)
+    assert.ok(reads > pausedReads, 'polling should resume')
+    stream.destroy()
+  })
+
+  it('should share one scheduler between connections of a server', async () => {
+    const pollScheduler = new PollScheduler()
+    const connections: ProcessProxyConnection[] = []
+    const { promise, resolve } = Promise.withResolvers<void>()
+    const count = 5
+
+    const testServer = await createTestServer(
+      (connection) => {
+        connections.push(connection)
+        connection.stdin.resume()
+        if (connections.length === count) {
+          resolve()
+        }
+      },
+      { pollScheduler },
+    )
+
+    const children = Array.from({ length: count }, () =>
+      spawnNativeProcess(testServer.port),
+    )
+
+    await promise
+    await delay(500)
+
+    assert.ok(pollScheduler.polls > 0, 'stdin should have been polled')
+    assert.ok(
+      pollScheduler.ticks < pollScheduler.polls,
+      `expected fewer wakeups (${pollScheduler.ticks}) than polls (${pollScheduler.polls})`,
+    )
+
+    await Promise.all(connections.map((c) => c.exit(0)))
+    await Promise.all(children.map(waitForExit))
+    await testServer.close()
+  })
+})
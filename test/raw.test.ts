@@ -0,0 +1,176 @@
+import { describe, it } from 'node:test'
+import assert from 'node:assert'
+import { spawn } from 'child_process'
+import { getProxyCommandPath } from '../src/index.js'
+import {
+  collectOutput,
+  createConnectionHandler,
+  createTestServer,
+  spawnNativeProcess,
+  waitForExit,
+} from './helpers.js'
+
+describe('Raw passthrough', () => {
+  it(
+    'should carry stdin unframed after an upgrade',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const payload = Buffer.alloc(4 * 1024 * 1024, 'r')
+
+      const { promise, handler } = createConnectionHandler<number>(
+        async (connection, resolve) => {
+          const stdin = await connection.upgradeStdin()
+          await assert.rejects(connection.getArgs(), /upgraded/)
+
+          let received = 0
+          for await (const chunk of stdin) {
+            received += chunk.length
+          }
+
+          await connection.exit(3)
+          resolve(received)
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      const child = spawnNativeProcess(testServer.port)
+      child.stdout.resume()
+      child.stdin.end(payload)
+
+      assert.strictEqual(await promise, payload.length)
+      assert.strictEqual(await waitForExit(child), 3)
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should exit a raw stdin session before stdin ends',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const { promise, handler } = createConnectionHandler<string>(
+        async (connection, resolve) => {
+          const stdin = await connection.upgradeStdin()
+          const chunk = await new Promise<Buffer>((r) => stdin.once('data', r))
+          await connection.exit(4)
+          resolve(chunk.toString())
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      const child = spawnNativeProcess(testServer.port)
+      child.stdout.resume()
+      child.stdin.write('hi')
+
+      assert.strictEqual(await promise, 'hi')
+      assert.strictEqual(await waitForExit(child), 4)
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should refuse to detach a raw connection',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const { promise, handler } = createConnectionHandler<void>(
+        async (connection, resolve) => {
+          await connection.upgradeStdin()
+          await assert.rejects(connection.detach(), /cannot be migrated/)
+          await connection.exit(0)
+          resolve()
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      const child = spawnNativeProcess(testServer.port)
+      child.stdout.resume()
+      child.stdin.end()
+
+      await promise
+      assert.strictEqual(await waitForExit(child), 0)
+      await testServer.close()
+    },
+  )
+
+  it('should carry stdout unframed after an upgrade', async () => {
+    const { promise, handler } = createConnectionHandler<void>(
+      async (connection, resolve) => {
+        connection.stdout.write('framed\n')
+        const stdout = await connection.upgradeStdout(2)
+        stdout.end('raw\n')
+        await connection.exit(2)
+        resolve()
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    const output = collectOutput(child.stdout)
+
+    await promise
+    assert.strictEqual(await waitForExit(child), 2)
+    assert.strictEqual(await output, 'framed\nraw\n')
+    await testServer.close()
+  })
+
+  it(
+    'should report a broken stdout instead of dying of SIGPIPE',
+    { skip: process.platform === 'win32' },
+    async () => {
+      const { promise, handler } = createConnectionHandler<string>(
+        async (connection, resolve) => {
+          const stdout = await connection.upgradeStdout(2)
+          stdout.on('error', () => {})
+          stdout.end(Buffer.alloc(1024 * 1024, 'p'))
+          resolve(await connection.exit(2).then(() => 'written', String))
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      const child = spawnNativeProcess(testServer.port)
+      // Nobody reads the proxy's stdout anymore
+      child.stdout.destroy()
+
+      assert.match(await promise, /pipe/i)
+      assert.strictEqual(await waitForExit(child), 2)
+      await testServer.close()
+    },
+  )
+
+  it(
+    'should drain raw stdout after a failed splice',
+    { skip: process.platform !== 'linux' },
+    async () => {
+      const { promise, handler } = createConnectionHandler<[boolean, string]>(
+        async (connection, resolve) => {
+          const stdout = await connection.upgradeStdout(2)
+          stdout.on('error', () => {})
+          // Far more than the socket buffers hold, the proxy has to keep
+          // reading for the write to finish
+          const written = new Promise<boolean>((r) =>
+            stdout.end(Buffer.alloc(16 * 1024 * 1024, 'p'), (e?: Error) =>
+              r(!e),
+            ),
+          )
+          const result = await connection.exit(2).then(() => 'written', String)
+          resolve([await written, result])
+        },
+      )
+
+      const testServer = await createTestServer(handler)
+      // Node gives children sockets for stdio, splice() only kicks in for a
+      // real pipe. Its reader exits straight away.
+      const child = spawn(
+        'sh',
+        ['-c', '("$0" test; echo "exit $?" >&2) | true', getProxyCommandPath()],
+        { env: { ...process.env, PROCESS_PROXY_PORT: `${testServer.port}` } },
+      )
+      const stderr = collectOutput(child.stderr)
+
+      const [written, result] = await promise
+      assert.strictEqual(written, true)
+      assert.match(result, /pipe/i)
+      assert.strictEqual(await stderr, 'exit 2\n')
+      await testServer.close()
+    },
+  )
+})
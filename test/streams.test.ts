@@ -408,4 +408,68 @@ describe('Stream Operations', () => {
     await waitForExit(child)
     await testServer.close()
   })
+
+  it('should grow the stdin read size for bulk input', async () => {
+    const payload = Buffer.alloc(8 * 1024 * 1024, 'z')
+    let largestChunk = 0
+    let largestReadSize = 0
+    let minReadSize = 0
+
+    const { promise, handler } = createConnectionHandler<number>(
+      (connection, resolve) => {
+        minReadSize = connection.stdin.minReadSize
+        let received = 0
+        connection.stdin.on('data', (data: Buffer) => {
+          received += data.length
+          largestChunk = Math.max(largestChunk, data.length)
+          largestReadSize = Math.max(
+            largestReadSize,
+            connection.stats.stdinReadSize,
+          )
+        })
+        connection.stdin.on('end', () => {
+          assert.strictEqual(connection.stats.stdinBytes, received)
+          connection.exit(0).then(() => resolve(received))
+        })
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    child.stdin.end(payload)
+
+    const received = await promise
+    await waitForExit(child)
+    await testServer.close()
+
+    assert.strictEqual(received, payload.length)
+    assert.ok(
+      largestReadSize > minReadSize,
+      `read size should grow beyond ${minReadSize} (${largestReadSize})`,
+    )
+    assert.ok(largestReadSize <= 1024 * 1024, 'read size should be capped')
+    assert.ok(largestChunk <= largestReadSize)
+  })
+
+  it('should report bytes written to stdout and stderr in stats', async () => {
+    const { promise, handler } = createConnectionHandler<void>(
+      async (connection, resolve) => {
+        await new Promise((r) => connection.stdout.write('hello', r))
+        await new Promise((r) => connection.stderr.write('oops!!', r))
+
+        assert.strictEqual(connection.stats.stdoutBytes, 5)
+        assert.strictEqual(connection.stats.stderrBytes, 6)
+        assert.ok(connection.stats.commands >= 2)
+
+        await connection.exit(0)
+        resolve()
+      },
+    )
+
+    const testServer = await createTestServer(handler)
+    const child = spawnNativeProcess(testServer.port)
+    await promise
+    await waitForExit(child)
+    await testServer.close()
+  })
 })